@@ -0,0 +1,215 @@
+#include "protocolhandler.c" // parse_message()'s pools & type tables are static
+#include "cJSON.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ *
+ * DECODER BENCHMARK:
+ * parse_message() AGAINST THE cJSON DECODE IT REPLACED, ON FRAMES SHAPED LIKE THE FRONTEND'S & THE AGENTS'
+ *
+ *      cjson  : cJSON_Parse() DOM, cJSON_GetObjectItem() PER KEY, STRINGS COPIED INTO POOL BUFFERS, cJSON_Delete()
+ *      stream : parse_message(), ONE PASS, STRINGS BORROWED FROM THE FRAME
+ *
+ *      BOTH DECODE A FRESH COPY OF THE FRAME EVERY ITERATION (parse_message() UNESCAPES IN PLACE), THE COPY IS TIMED FOR BOTH
+ *      THE TWO DECODES OF EVERY FRAME ARE COMPARED FIELD BY FIELD FIRST, EXIT STATUS 1 IF THEY DISAGREE
+ *
+ * ./bench_decode [iterations]
+ *
+ */
+
+#define BENCH_ITERATIONS 200000 // Decodes per frame, decoder & round
+#define BENCH_ROUNDS 5 // Best round is reported, a loaded host only ever slows one down
+#define BENCH_PAYLOAD 1500 // Bytes of the CMD_OUTPUT payload, under BUFFER_SIZE once unescaped
+
+typedef struct benchFrame {
+    const char* name;
+    char* json;
+    size_t len;
+} benchFrame;
+
+/*
+ *
+ * THE DECODE parse_message() HAD BEFORE THE STREAMING DECODER, KEPT HERE AS THE BASELINE
+ *
+ */
+static int bench_cjsonQueryString(cJSON* json, const char* name, char* out, size_t size) {
+    cJSON* item = cJSON_GetObjectItem(json, name);
+    if (!cJSON_IsString(item)) return 0;
+    if (strlen(item->valuestring) >= size) return 1;
+    snprintf(out, size, "%s", item->valuestring);
+    return 0;
+}
+
+static int bench_cjsonType(const protocolName* names, int count, const char* str) {
+    for (int i = 1; i < count; i++)
+        if (strcmp(names[i].str, str) == 0) return i;
+    return 0;
+}
+
+static PROTOCOL_MESSAGE* bench_cjsonDecode(char* jsonString) {
+    PROTOCOL_MESSAGE* msg = pool_alloc(&protocolMsg_pool);
+    if (!msg) return NULL;
+    memset(msg, 0, sizeof(PROTOCOL_MESSAGE)); // Owns its strings, borrowed = 0
+
+    cJSON* json = cJSON_Parse(jsonString);
+    if (!json) {
+        delete_protocol_msg(msg);
+        return NULL;
+    }
+
+    cJSON* type = cJSON_GetObjectItem(json, "type");
+    if (!cJSON_IsString(type) || !(msg->msg_type = bench_cjsonType(msgTypeNames, MSG_TYPE_COUNT, type->valuestring))) goto fail;
+
+    cJSON* content = cJSON_GetObjectItem(json, "content");
+    if (cJSON_IsString(content) && !(msg->content_type = bench_cjsonType(contentTypeNames, CONTENT_TYPE_COUNT, content->valuestring))) goto fail;
+
+    cJSON* destination = cJSON_GetObjectItem(json, "destination");
+    if (cJSON_IsString(destination) && !(msg->destination = pool_strndup(destination->valuestring, strlen(destination->valuestring)))) goto fail;
+
+    cJSON* source = cJSON_GetObjectItem(json, "source");
+    if (cJSON_IsString(source) && !(msg->source = pool_strndup(source->valuestring, strlen(source->valuestring)))) goto fail;
+
+    cJSON* selectedClient = cJSON_GetObjectItem(json, "selectedClient");
+    if (cJSON_IsString(selectedClient)) msg->specifiedClient = client_parseId(selectedClient->valuestring);
+
+    cJSON* request_id = cJSON_GetObjectItem(json, "request_id");
+    if (cJSON_IsNumber(request_id) && request_id->valuedouble > 0 && request_id->valuedouble <= UINT32_MAX)
+        msg->request_id = (uint32_t)request_id->valuedouble;
+
+    cJSON* timeout_ms = cJSON_GetObjectItem(json, "timeout_ms");
+    if (cJSON_IsNumber(timeout_ms) && timeout_ms->valuedouble >= 1 && timeout_ms->valuedouble <= UINT32_MAX)
+        msg->timeout_ms = (uint32_t)timeout_ms->valuedouble;
+
+    cJSON* payload_size = cJSON_GetObjectItem(json, "payload_size");
+    if (cJSON_IsNumber(payload_size)) msg->payload_size = payload_size->valueint;
+
+    cJSON* payload = cJSON_GetObjectItem(json, "payload");
+    if (cJSON_IsString(payload)) {
+        if (!(msg->payload = pool_bufAlloc(BUFFER_SIZE))) goto fail;
+        if (snprintf(msg->payload, BUFFER_SIZE, "%s", payload->valuestring) >= BUFFER_SIZE) goto fail;
+    }
+
+    cJSON* query = cJSON_GetObjectItem(json, "query");
+    if (cJSON_IsObject(query) && msg->msg_type == REQUEST && msg->content_type == CONNECTION_LIST) {
+        if (!(msg->query = pool_bufAlloc(sizeof(connectionQuery)))) goto fail;
+        memset(msg->query, 0, sizeof(connectionQuery));
+        cJSON* offset = cJSON_GetObjectItem(query, "offset");
+        if (cJSON_IsNumber(offset) && offset->valuedouble >= 0 && offset->valuedouble <= UINT32_MAX)
+            msg->query->offset = (uint32_t)offset->valuedouble;
+        cJSON* limit = cJSON_GetObjectItem(query, "limit");
+        if (cJSON_IsNumber(limit) && limit->valuedouble >= 1)
+            msg->query->limit = limit->valuedouble > LIST_PAGE_MAX ? LIST_PAGE_MAX : (uint32_t)limit->valuedouble;
+        if (bench_cjsonQueryString(query, "cursor", msg->query->cursor, sizeof(msg->query->cursor)) != 0 ||
+            bench_cjsonQueryString(query, "id_prefix", msg->query->id_prefix, sizeof(msg->query->id_prefix)) != 0 ||
+            bench_cjsonQueryString(query, "ip", msg->query->ip_prefix, sizeof(msg->query->ip_prefix)) != 0) goto fail;
+    }
+
+    if (msg->msg_type == COMMAND && (!msg->specifiedClient || !msg->payload)) goto fail;
+
+    cJSON_Delete(json);
+    return msg;
+
+fail:
+    cJSON_Delete(json);
+    delete_protocol_msg(msg);
+    return NULL;
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* bench_payloadFrame(size_t* len) { // CMD_OUTPUT chunk, log lines with escaped newlines, tabs & quotes
+    char* json = malloc(BENCH_PAYLOAD * 2 + 256);
+    if (!json) return NULL;
+    char* w = json + sprintf(json, "{\"type\":\"RESPONSE\",\"content\":\"CMD_OUTPUT\",\"destination\":\"" REACTFRONT "\","
+                                   "\"source\":\"" CSERVER "\",\"selectedClient\":\"cli17\",\"request_id\":4242,\"payload\":\"");
+    static const char line[] = "Oct 18 12:00:01 host sshd[811]:\\tAccepted \\\"publickey\\\" for root\\n";
+    for (size_t n = 0; n + sizeof(line) - 1 <= BENCH_PAYLOAD; n += sizeof(line) - 1) w += sprintf(w, "%s", line);
+    w += sprintf(w, "\",\"payload_size\":%d}", BENCH_PAYLOAD);
+    *len = w - json;
+    return json;
+}
+
+static int bench_check(const char* name, PROTOCOL_MESSAGE* a, PROTOCOL_MESSAGE* b) {
+    int same = a && b && a->msg_type == b->msg_type && a->content_type == b->content_type &&
+               a->specifiedClient == b->specifiedClient && a->request_id == b->request_id &&
+               a->timeout_ms == b->timeout_ms && a->payload_size == b->payload_size &&
+               !a->payload == !b->payload && (!a->payload || strcmp(a->payload, b->payload) == 0) &&
+               !a->query == !b->query && (!a->query || (a->query->offset == b->query->offset &&
+               a->query->limit == b->query->limit && strcmp(a->query->id_prefix, b->query->id_prefix) == 0));
+    if (!same) fprintf(stderr, "[ERROR] [bench_decode/bench_check] Decoders disagree on %s\n", name);
+    return same ? 0 : 1;
+}
+
+static double bench_run(const benchFrame* f, char* work, long iterations, int stream) { // ns per decode, best round
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        double start = bench_now();
+        for (long i = 0; i < iterations; i++) {
+            memcpy(work, f->json, f->len + 1);
+            PROTOCOL_MESSAGE* msg = stream ? parse_message(work, f->len) : bench_cjsonDecode(work);
+            if (!msg) {
+                fprintf(stderr, "[ERROR] [bench_decode/bench_run] Decode of %s failed\n", f->name);
+                exit(1);
+            }
+            delete_protocol_msg(msg);
+        }
+        double ns = (bench_now() - start) * 1e9 / iterations;
+        if (round == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : BENCH_ITERATIONS;
+    if (iterations < 1) iterations = BENCH_ITERATIONS;
+    pthread_once(&typeTables_once, type_tablesInit);
+
+    benchFrame frames[] = {
+        { "COMMAND", "{\"type\":\"COMMAND\",\"destination\":\"" CSERVER "\",\"source\":\"" REACTFRONT "\","
+                     "\"selectedClient\":\"cli3\",\"request_id\":17,\"timeout_ms\":30000,"
+                     "\"payload\":\"ls -la /var/log && uname -a\",\"payload_size\":27}", 0 },
+        { "REQUEST list", "{\"type\":\"REQUEST\",\"content\":\"CONNECTION_LIST\",\"destination\":\"" CSERVER "\","
+                          "\"source\":\"" REACTFRONT "\",\"query\":{\"offset\":200,\"limit\":100,\"id_prefix\":\"cli1\"}}", 0 },
+        { "BEACON", "{\"type\":\"BEACON\",\"source\":\"" REACTFRONT "\",\"destination\":\"" CSERVER "\"}", 0 },
+        { "CMD_OUTPUT 1.5K", NULL, 0 },
+    };
+    int count = sizeof(frames) / sizeof(frames[0]);
+    if (!(frames[count - 1].json = bench_payloadFrame(&frames[count - 1].len))) return 1;
+
+    size_t max = 0;
+    for (int i = 0; i < count; i++) {
+        if (!frames[i].len) frames[i].len = strlen(frames[i].json);
+        if (frames[i].len > max) max = frames[i].len;
+    }
+    char* work = malloc(max + 1);
+    char* ref = malloc(max + 1);
+    if (!work || !ref) return 1;
+
+    printf("%-16s %8s %12s %12s %9s\n", "frame", "bytes", "cjson ns", "stream ns", "speedup");
+    int errors = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(ref, frames[i].json, frames[i].len + 1);
+        memcpy(work, frames[i].json, frames[i].len + 1);
+        PROTOCOL_MESSAGE* a = bench_cjsonDecode(ref);
+        PROTOCOL_MESSAGE* b = parse_message(work, frames[i].len);
+        errors += bench_check(frames[i].name, a, b);
+        delete_protocol_msg(a);
+        delete_protocol_msg(b);
+
+        double cjson = bench_run(&frames[i], work, iterations, 0);
+        double stream = bench_run(&frames[i], work, iterations, 1);
+        printf("%-16s %8zu %12.1f %12.1f %8.1fx\n", frames[i].name, frames[i].len, cjson, stream, cjson / stream);
+    }
+
+    free(frames[count - 1].json);
+    free(work);
+    free(ref);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+#include "websocket.c" // The masking kernels are static
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ *
+ * MASKING THROUGHPUT BENCHMARK:
+ * GB/s OF ONE CORE PER KERNEL & PAYLOAD SIZE, THE BUFFER IS MASKED IN PLACE OVER & OVER LIKE websocket_frame() DOES
+ *
+ *      bytes : THE apply_mask() LOOP THE KERNELS REPLACED, data[i] ^= mask[i % 4] (THE COMPILER MAY VECTORIZE IT)
+ *      words : 8 BYTES PER STEP, THE FALLBACK    sse2 : 16    avx2 : 32, 128 PER UNROLLED STEP
+ *
+ *      BENCH_BYTES ARE MASKED PER SIZE, KERNEL & ROUND, THE BEST ROUND IS REPORTED
+ *
+ * ./bench_mask
+ *
+ */
+
+#define BENCH_BYTES (256UL << 20) // Per size, kernel & round
+#define BENCH_ROUNDS 3
+#define BENCH_KERNELS 4
+
+typedef struct maskKernel {
+    const char* name;
+    void (*fn)(unsigned char* data, size_t len, uint32_t key);
+} maskKernel;
+
+static void mask_bytes(unsigned char* data, size_t len, uint32_t key) {
+    const unsigned char* mask = (const unsigned char*)&key;
+    for (size_t i = 0; i < len; i++)
+        data[i] ^= mask[i % 4];
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_run(const maskKernel* k, unsigned char* data, size_t len) { // GB/s, best round
+    size_t iterations = BENCH_BYTES / len;
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        double start = bench_now();
+        for (size_t i = 0; i < iterations; i++)
+            k->fn(data, len, 0x5A3C9F17u);
+        double gbps = (double)iterations * len / (bench_now() - start) / 1e9;
+        if (gbps > best) best = gbps;
+    }
+    return best;
+}
+
+int main() {
+    maskKernel kernels[BENCH_KERNELS];
+    int count = 0;
+    kernels[count++] = (maskKernel){ "bytes", mask_bytes };
+    kernels[count++] = (maskKernel){ "words", mask_words };
+#if defined(__x86_64__)
+    kernels[count++] = (maskKernel){ "sse2", mask_sse2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernels[count++] = (maskKernel){ "avx2", mask_avx2 };
+#endif
+
+    static const size_t sizes[] = { 125, 1024, 64 << 10, 1 << 20, 16 << 20 }; // Control frame max ... multi-megabyte output
+    unsigned char* data = malloc(16 << 20);
+    if (!data) return 1;
+    memset(data, 'x', 16 << 20);
+
+    printf("%10s", "bytes");
+    for (int k = 0; k < count; k++) printf(" %8s", kernels[k].name);
+    printf("   (GB/s)\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf("%10zu", sizes[s]);
+        for (int k = 0; k < count; k++) printf(" %8.2f", bench_run(&kernels[k], data, sizes[s]));
+        printf("\n");
+    }
+
+    free(data);
+    return 0;
+}
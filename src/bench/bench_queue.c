@@ -0,0 +1,112 @@
+#include "client_mgmt.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+/*
+ *
+ * QUEUE THROUGHPUT BENCHMARK:
+ * N PRODUCERS, EACH PUSHING BENCH_OPS FRAMES, DRAINED THE WAY A REACTOR WORKER DRAINS A command_queue
+ *
+ *      per-queue : EVERY PRODUCER HAS ITS OWN Queue & CONSUMER (ONE AGENT EACH), SHOULD SCALE WITH N
+ *      shared    : ALL PRODUCERS PUSH INTO ONE Queue, ONE CONSUMER, THE CONTENDED BASELINE
+ *
+ * ./bench_queue [max_threads], THREAD COUNTS DOUBLE FROM 1
+ *
+ */
+
+#define BENCH_OPS 1000000 // Frames per producer
+#define BENCH_FRAME 64 // Bytes per frame
+#define BENCH_MAX_THREADS 64
+
+typedef struct benchQueue {
+    Queue* q;
+    long expected; // Frames its consumer waits for
+} benchQueue;
+
+static void* bench_producer(void* arg) {
+    Queue* q = ((benchQueue*)arg)->q;
+    for (long i = 0; i < BENCH_OPS; i++) {
+        char* frame = pool_bufAlloc(BENCH_FRAME);
+        queueNode* node = frame ? queue_createNode(frame, BENCH_FRAME) : NULL;
+        if (!node || queue_push(q, node) != 0) {
+            fprintf(stderr, "[ERROR] [bench_queue/bench_producer] Push failed\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void* bench_consumer(void* arg) {
+    benchQueue* bq = arg;
+    struct pollfd pfd = { .fd = bq->q->event_fd, .events = POLLIN };
+    long got = 0;
+    while (got < bq->expected) {
+        poll(&pfd, 1, -1);
+        queue_ackEvent(bq->q); // Before draining, like handle_client_commands()
+        char* frame;
+        while ((frame = queue_pop(bq->q, NULL)) != NULL) {
+            pool_bufFree(frame);
+            got++;
+        }
+    }
+    return NULL;
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Frames per second through the queues, shared: one queue for every producer
+static double bench_run(int threads, int shared) {
+    int queues = shared ? 1 : threads;
+    benchQueue bq[BENCH_MAX_THREADS];
+    pthread_t producers[BENCH_MAX_THREADS], consumers[BENCH_MAX_THREADS];
+    for (int i = 0; i < queues; i++) {
+        bq[i].q = malloc(sizeof(Queue));
+        if (!bq[i].q) {
+            fprintf(stderr, "[ERROR] [bench_queue/bench_run] Failed to allocate a Queue\n");
+            exit(1);
+        }
+        queue_init(bq[i].q);
+        bq[i].expected = shared ? (long)threads * BENCH_OPS : BENCH_OPS;
+    }
+
+    double start = bench_now();
+    for (int i = 0; i < queues; i++)
+        pthread_create(&consumers[i], NULL, bench_consumer, &bq[i]);
+    for (int i = 0; i < threads; i++)
+        pthread_create(&producers[i], NULL, bench_producer, &bq[shared ? 0 : i]);
+    for (int i = 0; i < threads; i++)
+        pthread_join(producers[i], NULL);
+    for (int i = 0; i < queues; i++)
+        pthread_join(consumers[i], NULL);
+    double elapsed = bench_now() - start;
+
+    for (int i = 0; i < queues; i++)
+        queue_destroy(bq[i].q);
+    return (double)threads * BENCH_OPS / elapsed;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (max_threads < 1 || max_threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "[ERROR] [bench_queue/main] max_threads must be 1 to %d\n", BENCH_MAX_THREADS);
+        return 1;
+    }
+    printf("%-8s %16s %16s\n", "threads", "per-queue Mops/s", "shared Mops/s");
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double own = bench_run(threads, 0);
+        double shared = bench_run(threads, 1);
+        if (threads == 1) base = own;
+        printf("%-8d %10.2f (x%.1f) %16.2f\n", threads, own / 1e6, own / base, shared / 1e6);
+        fflush(stdout);
+    }
+    return 0;
+}
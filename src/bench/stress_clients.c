@@ -0,0 +1,174 @@
+#include "client_mgmt.h"
+#include "pool.h"
+#include "ebr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+/*
+ *
+ * CLIENT CHURN STRESS TEST:
+ * AGENTS CONNECT & DISCONNECT NONSTOP WHILE OTHER THREADS LOOK THEM UP & DISPATCH COMMANDS TO THEM
+ *
+ *      churn    : slot_put() A NEW CLIENT INTO A RANDOM SLOT OF live[], slot_remove() WHATEVER WAS THERE
+ *      dispatch : slot_grab() A RANDOM (OFTEN STALE) HANDLE, queue_push() A COMMAND, CHECK THE CLIENT, client_release()
+ *      drain    : slot_grab() & queue_pop() LIKE A REACTOR WORKER FLUSHING A command_queue
+ *      walk     : slot_forEach() OVER THE REGISTRY, READING EVERY CLIENT'S ip
+ *
+ * BUILT WITH -fsanitize=address (OR thread) THE POOLS PASS THROUGH TO malloc, SO ANY USE-AFTER-FREE OR RACE IS REPORTED
+ * ./stress_clients [seconds], EXIT STATUS 1 IF A LOOKUP EVER RETURNED THE WRONG CLIENT
+ *
+ */
+
+#define STRESS_LIVE 512 // Handles the churn threads keep registered
+#define STRESS_CHURN 2
+#define STRESS_DISPATCH 4
+#define STRESS_DRAIN 1
+#define STRESS_WALK 1
+#define STRESS_THREADS (STRESS_CHURN + STRESS_DISPATCH + STRESS_DRAIN + STRESS_WALK)
+#define STRESS_IP "10.0.0.1"
+
+static atomic_uint live[STRESS_LIVE]; // clientHandle, 0 when empty
+static atomic_int stop;
+static atomic_long connects, disconnects, grabs, misses, dispatched, drained, walked, errors;
+static pthread_barrier_t finished;
+
+static uint32_t stress_rand(uint32_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static clientHandle stress_pick(uint32_t* seed) {
+    return atomic_load(&live[stress_rand(seed) % STRESS_LIVE]);
+}
+
+// Every thread leaves through here: once nobody reads anymore, its retired clients can all be reclaimed
+static void* stress_finish() {
+    pthread_barrier_wait(&finished);
+    for (int i = 0; i < 3; i++) // Two epochs past the last retirement
+        ebr_collect();
+    return NULL;
+}
+
+static void* stress_churn(void* arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u | 1;
+    while (!atomic_load(&stop)) {
+        int fd = eventfd(0, EFD_CLOEXEC); // Stands in for the agent's socket, closed by the last client_release()
+        char* ip = pool_strndup(STRESS_IP, strlen(STRESS_IP));
+        client* cli = fd != -1 && ip ? createClient(fd, ip) : NULL;
+        if (!cli) {
+            atomic_fetch_add(&errors, 1);
+            continue;
+        }
+        clientHandle handle = slot_put(clientSlots, cli);
+        client_release(cli); // clientSlots holds the only reference now
+        if (!handle) continue;
+        atomic_fetch_add(&connects, 1);
+
+        clientHandle old = atomic_exchange(&live[stress_rand(&seed) % STRESS_LIVE], handle);
+        if (old && slot_remove(clientSlots, old) == 0)
+            atomic_fetch_add(&disconnects, 1);
+    }
+    return stress_finish();
+}
+
+static void* stress_dispatch(void* arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u | 1;
+    while (!atomic_load(&stop)) {
+        clientHandle handle = stress_pick(&seed);
+        client* cli = handle ? slot_grab(clientSlots, handle) : NULL;
+        if (!cli) {
+            atomic_fetch_add(&misses, 1);
+            continue;
+        }
+        atomic_fetch_add(&grabs, 1);
+        if (cli->handle != handle || strcmp(cli->ip, STRESS_IP) != 0) {
+            fprintf(stderr, "[ERROR] [stress_clients/stress_dispatch] slot_grab(" CLIENT_ID_FMT ") returned " CLIENT_ID_FMT "\n", handle, cli->handle);
+            atomic_fetch_add(&errors, 1);
+        }
+        char* command = pool_bufAlloc(64);
+        queueNode* node = command ? queue_createNode(command, 64) : NULL;
+        if (node && queue_push(cli->command_queue, node) == 0) atomic_fetch_add(&dispatched, 1);
+        else pool_bufFree(command);
+        client_release(cli);
+    }
+    return stress_finish();
+}
+
+static void* stress_drain(void* arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u | 1;
+    while (!atomic_load(&stop)) {
+        clientHandle handle = stress_pick(&seed);
+        client* cli = handle ? slot_grab(clientSlots, handle) : NULL;
+        if (!cli) continue;
+        queue_ackEvent(cli->command_queue);
+        char* command;
+        while ((command = queue_pop(cli->command_queue, NULL)) != NULL) {
+            pool_bufFree(command);
+            atomic_fetch_add(&drained, 1);
+        }
+        client_release(cli);
+    }
+    return stress_finish();
+}
+
+static void count_client(client* cli, void* arg) {
+    if (strcmp(cli->ip, STRESS_IP) != 0) atomic_fetch_add(&errors, 1);
+    (*(long*)arg)++;
+}
+
+static void* stress_walk(void* arg) {
+    (void)arg;
+    while (!atomic_load(&stop)) {
+        long n = 0;
+        slot_forEach(clientSlots, count_client, &n);
+        atomic_fetch_add(&walked, n);
+    }
+    return stress_finish();
+}
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    if (!freopen("/dev/null", "w", stdout)) { // slot_put() prints every connection
+        fprintf(stderr, "[ERROR] [stress_clients/main] Failed to silence stdout\n");
+        return 1;
+    }
+    clientSlots = slot_init();
+    if (!clientSlots) return 1;
+    pthread_barrier_init(&finished, NULL, STRESS_THREADS);
+
+    pthread_t threads[STRESS_THREADS];
+    void* (*roles[STRESS_THREADS])(void*);
+    int n = 0;
+    for (int i = 0; i < STRESS_CHURN; i++) roles[n++] = stress_churn;
+    for (int i = 0; i < STRESS_DISPATCH; i++) roles[n++] = stress_dispatch;
+    for (int i = 0; i < STRESS_DRAIN; i++) roles[n++] = stress_drain;
+    for (int i = 0; i < STRESS_WALK; i++) roles[n++] = stress_walk;
+    for (int i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, roles[i], (void*)(uintptr_t)(i + 1));
+
+    struct timespec wait = { .tv_sec = seconds };
+    nanosleep(&wait, NULL);
+    atomic_store(&stop, 1);
+    for (int i = 0; i < STRESS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < STRESS_LIVE; i++) {
+        clientHandle handle = atomic_load(&live[i]);
+        if (handle) slot_remove(clientSlots, handle);
+    }
+    for (int i = 0; i < 3; i++)
+        ebr_collect();
+    slot_destroy(clientSlots);
+    free(clientSlots);
+    pthread_barrier_destroy(&finished);
+
+    fprintf(stderr, "%d s: %ld connects, %ld disconnects, %ld grabs (%ld stale), %ld commands dispatched, %ld drained, %ld clients walked, %ld errors\n",
+            seconds, atomic_load(&connects), atomic_load(&disconnects), atomic_load(&grabs), atomic_load(&misses),
+            atomic_load(&dispatched), atomic_load(&drained), atomic_load(&walked), atomic_load(&errors));
+    return atomic_load(&errors) ? 1 : 0;
+}
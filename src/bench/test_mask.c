@@ -0,0 +1,98 @@
+#include "websocket.c" // The masking kernels are static
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *
+ * MASKING KERNELS TEST:
+ * EVERY KERNEL THE CPU CAN RUN AGAINST THE BYTE-AT-A-TIME DEFINITION (RFC 6455 5.3), BYTE FOR BYTE
+ *
+ *      EVERY LENGTH 0 .. TEST_MAX_LEN AT EVERY OFFSET 0 .. TEST_OFFSETS - 1 FROM AN ALIGNED BASE, SO EVERY
+ *      HEAD / TAIL SPLIT OF THE 8, 16, 32 & 128-BYTE STEPS IS HIT, PLUS A FEW FRAME-SIZED LENGTHS
+ *      GUARD BYTES ON BOTH SIDES OF THE RANGE MUST STAY UNTOUCHED
+ *
+ * ./test_mask, EXIT STATUS 1 ON THE FIRST MISMATCH
+ *
+ */
+
+#define TEST_MAX_LEN 300 // Covers two AVX2 128-byte steps & every tail after them
+#define TEST_OFFSETS 64
+#define TEST_GUARD 64 // Bytes checked before & after the masked range
+#define TEST_GUARD_BYTE 0xA5
+
+typedef struct maskKernel {
+    const char* name;
+    void (*fn)(unsigned char* data, size_t len, uint32_t key);
+} maskKernel;
+
+static void test_reference(unsigned char* data, size_t len, const unsigned char* mask) {
+    for (size_t i = 0; i < len; i++)
+        data[i] ^= mask[i % 4];
+}
+
+static int test_one(const maskKernel* k, unsigned char* buf, unsigned char* expected, size_t offset, size_t len) {
+    unsigned char mask[4];
+    generate_masking_key(mask);
+
+    unsigned char* data = buf + TEST_GUARD + offset;
+    memset(buf, TEST_GUARD_BYTE, TEST_GUARD + offset);
+    for (size_t i = 0; i < len; i++)
+        data[i] = (unsigned char)rand();
+    memset(data + len, TEST_GUARD_BYTE, TEST_GUARD);
+    memcpy(expected, data, len);
+
+    uint32_t key;
+    memcpy(&key, mask, 4); // As apply_mask() does
+    k->fn(data, len, key);
+    test_reference(expected, len, mask);
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != expected[i]) {
+            fprintf(stderr, "[ERROR] [test_mask/test_one] %s: offset %zu len %zu, byte %zu is 0x%02x, expected 0x%02x\n",
+                    k->name, offset, len, i, data[i], expected[i]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < TEST_GUARD; i++) {
+        if (buf[TEST_GUARD + offset - 1 - i] != TEST_GUARD_BYTE || data[len + i] != TEST_GUARD_BYTE) {
+            fprintf(stderr, "[ERROR] [test_mask/test_one] %s: offset %zu len %zu, wrote outside the range\n", k->name, offset, len);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    maskKernel kernels[3];
+    int count = 0;
+    kernels[count++] = (maskKernel){ "words", mask_words };
+#if defined(__x86_64__)
+    kernels[count++] = (maskKernel){ "sse2", mask_sse2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernels[count++] = (maskKernel){ "avx2", mask_avx2 };
+    else printf("avx2: not supported by this CPU, skipped\n");
+#endif
+
+    static const size_t frame_lens[] = { 1023, 1024, 4097, WS_FRAGMENT_SIZE - 1, WS_FRAGMENT_SIZE + 13 };
+    size_t max = WS_FRAGMENT_SIZE + 13;
+    unsigned char* buf = malloc(2 * TEST_GUARD + TEST_OFFSETS + max);
+    unsigned char* expected = malloc(max);
+    if (!buf || !expected) return 1;
+
+    srand(1);
+    for (int k = 0; k < count; k++) {
+        long cases = 0;
+        for (size_t offset = 0; offset < TEST_OFFSETS; offset++) {
+            for (size_t len = 0; len <= TEST_MAX_LEN; len++, cases++)
+                if (test_one(&kernels[k], buf, expected, offset, len)) return 1;
+            for (size_t i = 0; i < sizeof(frame_lens) / sizeof(frame_lens[0]); i++, cases++)
+                if (test_one(&kernels[k], buf, expected, offset, frame_lens[i])) return 1;
+        }
+        printf("%s: %ld cases match\n", kernels[k].name, cases);
+    }
+
+    free(buf);
+    free(expected);
+    return 0;
+}
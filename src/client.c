@@ -1,14 +1,98 @@
-#define _POSIX_C_SOURCE 2 // Or try _XOPEN_SOURCE 500 if that doesn't work. This is for popen() to not give undeclared error
+#define _POSIX_C_SOURCE 200809L // popen(), posix_spawn(), poll(), clock_gettime()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h> // For pipe on Linux/macOS
+#ifndef _WIN32
+#include <sys/wait.h> // waitpid() for the runner shells
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <spawn.h>
+#endif
 
 #include "common.h"
+#include "wire.h"
 #include <signal.h> // For signal handling
 
+#define AGENT_MAX_INFLIGHT 8 // Commands running at once, the next command stays in the receive buffer until a shell is idle
+#define SHELL_PATH "/bin/sh"
+#define SENTINEL_MAX 64 // Marker the shell prints after each command, followed by its exit status
+#define AGENT_OUTBOX_MAX (1 << 20) // Bytes queued for the server past which the shells' output is left in their pipes
+#define AGENT_KILLED_STATUS (128 + 9) // Exit status reported for a command killed at its deadline, what sh reports after SIGKILL
+
 volatile sig_atomic_t client_running = 1; // for signal handling
 
+#ifndef _WIN32
+extern char** environ;
+
+typedef struct agentShell {
+    pid_t pid; // 0 until spawned, or after the shell died
+    int in_fd; // Shell's stdin, commands are written here (non-blocking)
+    int out_fd; // Shell's stdout (non-blocking)
+    int err_fd; // Shell's stderr (non-blocking), -1 once closed
+    int busy;
+    uint32_t request_id; // Command running on it while busy
+    uint32_t timeout_ms; // Its deadline as the server sent it, 0 for none
+    long deadline; // now_ms() past which it is killed, 0 for none
+    char* script; // Rest of the command not yet accepted by the shell's stdin
+    size_t script_len;
+    size_t script_off;
+    char out[WIRE_CHUNK_SIZE + SENTINEL_MAX + 16]; // Stdout not forwarded yet + room for the sentinel & the status line
+    size_t out_len;
+    char sentinel[SENTINEL_MAX];
+    size_t sentinel_len;
+} agentShell;
+
+static agentShell shells[AGENT_MAX_INFLIGHT]; // One long-lived shell per runner, respawned when it dies
+
+typedef struct agentOutbox { // Frames for the server the non-blocking socket did not take yet, in order
+    char* data;
+    size_t len;
+    size_t off; // Bytes of data already sent
+    size_t cap;
+} agentOutbox;
+
+static agentOutbox outbox;
+
+static size_t outbox_pending() {
+    return outbox.len - outbox.off;
+}
+
+static int outbox_append(const void* bytes, size_t n) {
+    if (outbox.off > 0 && outbox.cap - outbox.len < n) { // Slide the unsent tail to the front first
+        memmove(outbox.data, outbox.data + outbox.off, outbox.len - outbox.off);
+        outbox.len -= outbox.off;
+        outbox.off = 0;
+    }
+    if (outbox.cap - outbox.len < n) {
+        size_t cap = outbox.cap ? outbox.cap : WIRE_RECV_CHUNK;
+        while (cap - outbox.len < n) cap <<= 1;
+        char* data = realloc(outbox.data, cap);
+        if (!data) return -1;
+        outbox.data = data;
+        outbox.cap = cap;
+    }
+    memcpy(outbox.data + outbox.len, bytes, n);
+    outbox.len += n;
+    return 0;
+}
+
+// Sends what the socket takes without blocking, the rest waits for POLLOUT. -1 if the connection is gone
+static int outbox_flush(int client_socket) {
+    while (outbox.off < outbox.len) {
+        ssize_t sent = send(client_socket, outbox.data + outbox.off, outbox.len - outbox.off, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        outbox.off += sent;
+    }
+    outbox.off = outbox.len = 0;
+    return 0;
+}
+#endif
+
 void signal_handler(int sig) {
     if (sig == SIGINT||sig == SIGTERM) {
         client_running = 0;
@@ -16,10 +100,570 @@ void signal_handler(int sig) {
     }
 }
 
+int agent_sendFrame(int client_socket, uint8_t type, uint32_t request_id, const char* payload, size_t len) {
+#ifdef _WIN32
+    return wire_sendFrame(client_socket, type, request_id, payload, (uint32_t)len);
+#else
+    unsigned char hdr[WIRE_HEADER_SIZE]; // Queued whole, a frame is never split by a full socket buffer
+    wire_encodeHeader(hdr, type, request_id, (uint32_t)len);
+    if (outbox_append(hdr, WIRE_HEADER_SIZE) != 0 || (len > 0 && outbox_append(payload, len) != 0)) {
+        fprintf(stderr, "Failed to queue a frame for the server\n");
+        return -1;
+    }
+    return outbox_flush(client_socket);
+#endif
+}
+
+static int send_end(int client_socket, uint32_t request_id, int status) {
+    char exit_status[16];
+    snprintf(exit_status, sizeof(exit_status), "%d", status);
+    return agent_sendFrame(client_socket, WIRE_OUTPUT_END, request_id, exit_status, strlen(exit_status));
+}
+
+/*
+ * HERE LIES COMMAND EXECUTION AND SENDING BACK OUTPUT
+ * PRIVILEGE ESCALATION SHOULD BE REMEMBERED, MUST BE IMPLEMENTED TO RUN CERTAIN COMMANDS ON CLIENT MACHINE
+ *
+ * OUTPUT IS STREAMED AS IT IS PRODUCED: WIRE_OUTPUT_START, WIRE_OUTPUT / WIRE_OUTPUT_STDERR CHUNKS (<= WIRE_CHUNK_SIZE), WIRE_OUTPUT_END + EXIT STATUS
+ * ALL CARRYING THE COMMAND'S request_id, MEMORY PER COMMAND IS ONE CHUNK WHATEVER THE OUTPUT SIZE
+ *
+ * RUNNER SHELLS (NOT ON WINDOWS, WHICH KEEPS popen() & RUNS COMMANDS ONE AFTER ANOTHER):
+ *      EACH RUNNER OWNS ONE LONG-LIVED /bin/sh, posix_spawn()ED WITH STDIN, STDOUT & STDERR PIPES, IT SAVES A SPAWN PER COMMAND
+ *      RUNNERS ARE STATELESS: EVERY COMMAND RUNS IN A SUBSHELL, cd, VARIABLES & exit END WITH IT, WHICHEVER RUNNER PICKS IT UP
+ *      A COMMAND IS SENT AS:  ( eval '<cmd>' ) </dev/null; printf '%s%d\n' '<sentinel>' "$?"
+ *          THE SUBSHELL KEEPS SYNTAX ERRORS & exit FROM KILLING THE RUNNER, </dev/null KEEPS THE COMMAND OFF THE SHELL'S STDIN
+ *          STDOUT BEFORE THE SENTINEL IS OUTPUT, THE NUMBER AFTER IT IS THE EXIT STATUS
+ *          STDERR IS FORWARDED ON ITS OWN, WHAT IS LEFT IN ITS PIPE IS DRAINED BEFORE WIRE_OUTPUT_END
+ *      A RUNNER THAT DIES ANYWAY (KILLED FROM OUTSIDE) GETS A NEW SHELL ON THE NEXT RUN
+ *      A BACKGROUND JOB THAT OUTLIVES ITS COMMAND KEEPS THE RUNNER'S PIPES: WHILE THE RUNNER IS IDLE ITS OUTPUT IS READ & DROPPED
+ *          (LOGGED BY SIZE), ONCE THE RUNNER TAKES THE NEXT COMMAND IT CANNOT BE TOLD APART, REDIRECT SUCH JOBS (cmd >log 2>&1 &)
+ *      EACH SHELL LEADS ITS OWN PROCESS GROUP, CLOSING IT SIGKILLS THE GROUP: NOTHING A COMMAND STARTED OUTLIVES ITS RUNNER
+ *
+ * DEADLINES:
+ *      EVERY WIRE_COMMAND CARRIES THE SERVER'S timeout_ms, COUNTED FROM THE MOMENT A SHELL PICKS THE COMMAND UP
+ *      PAST IT THE RUNNER IS KILLED, A STDERR NOTE & WIRE_OUTPUT_END AGENT_KILLED_STATUS GO OUT, THE NEXT COMMAND RESPAWNS IT
+ *      SO A HUNG COMMAND HOLDS ITS RUNNER FOR timeout_ms AT MOST, NEVER FOREVER
+ *
+ * ONE poll() LOOP, NO THREADS:
+ *      THE SERVER SOCKET & EVERY SHELL'S PIPES ARE WATCHED TOGETHER, poll() WAKES FOR THE NEXT BEACON OR DEADLINE
+ *      THE SOCKET IS ONLY READ WHILE A SHELL IS IDLE, WHICH BACKPRESSURES THE SERVER THROUGH TCP
+ *      THE SOCKET IS NON-BLOCKING: FRAMES GO THROUGH outbox, WHAT IT DOES NOT TAKE IS SENT ON POLLOUT, NOTHING EVER WAITS ON send()
+ *      PAST AGENT_OUTBOX_MAX QUEUED BYTES THE SHELLS' OUTPUT STAYS IN THEIR PIPES, WHICH BACKPRESSURES THE COMMANDS
+ *      A WIRE_BEACON GOES OUT EVERY WIRE_BEACON_INTERVAL, WHATEVER THE COMMANDS ARE DOING
+ */
+#ifdef _WIN32
+static int popen_execute(int client_socket, uint32_t request_id, const char* command, int* status) {
+    FILE *fp = popen(command, "r"); // Execute command, read output
+    if (fp == NULL) {
+        char err[BUFFER_SIZE];
+        snprintf(err, sizeof(err), "popen() failed: %s", strerror(ERRNO));
+        return agent_sendFrame(client_socket, WIRE_OUTPUT_STDERR, request_id, err, strlen(err)); // Send popen() failure error message to server
+    }
+
+    // Forward whatever the pipe has as soon as it has it, one fixed chunk buffer per command
+    char chunk[WIRE_CHUNK_SIZE];
+    int n;
+    while ((n = read(fileno(fp), chunk, sizeof(chunk))) > 0) {
+        if (agent_sendFrame(client_socket, WIRE_OUTPUT, request_id, chunk, n) == -1) {
+            pclose(fp);
+            return -1;
+        }
+    }
+    *status = pclose(fp);
+    if (*status == -1) fprintf(stderr, "pclose() failed: %d\n", ERRNO);
+    return 0;
+}
+
+int run_command(int client_socket, uint32_t request_id, const char* command) {
+    if (agent_sendFrame(client_socket, WIRE_OUTPUT_START, request_id, NULL, 0) == -1) {
+        fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+        return -1;
+    }
+
+    int status = -1;
+    if (popen_execute(client_socket, request_id, command, &status) == -1 || send_end(client_socket, request_id, status) == -1) {
+        fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    return 0;
+}
+#else
+static int send_output(int client_socket, uint8_t type, uint32_t request_id, const char* data, size_t len) {
+    while (len > 0) {
+        size_t n = len > WIRE_CHUNK_SIZE ? WIRE_CHUNK_SIZE : len;
+        if (agent_sendFrame(client_socket, type, request_id, data, n) == -1) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void fd_setFlags(int fd, int nonblock) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // Only the shell's own 0/1/2 copies survive exec
+    if (nonblock) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Closes the pipes, kills the shell's process group & reaps the shell, its exit status if it already exited on its own, else -1
+static int shell_close(agentShell* sh) {
+    if (sh->pid == 0) return -1;
+    close(sh->in_fd);
+    close(sh->out_fd);
+    if (sh->err_fd != -1) close(sh->err_fd);
+    int status = -1;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, sh->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == sh->pid && info.si_code == CLD_EXITED)
+        status = info.si_status; // Left unreaped, so the group id cannot be reused before the kill below
+    kill(-sh->pid, SIGKILL); // The command & whatever it left running (pipelines, background jobs), not only the shell
+    waitpid(sh->pid, NULL, 0);
+    free(sh->script);
+    sh->script = NULL;
+    sh->err_fd = -1;
+    sh->pid = 0;
+    return status;
+}
+
+static int shell_spawn(agentShell* sh) {
+    int in[2], out[2], err[2];
+    if (pipe(in) == -1) return -1;
+    if (pipe(out) == -1) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    if (pipe(err) == -1) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    // Other shells must not inherit these, or EOF never shows up. Single-threaded, so nothing can spawn in between
+    fd_setFlags(in[0], 0);
+    fd_setFlags(out[1], 0);
+    fd_setFlags(err[1], 0);
+    fd_setFlags(in[1], 1);
+    fd_setFlags(out[0], 1);
+    fd_setFlags(err[0], 1);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+    posix_spawnattr_t attr; // Own process group, shell_close() kills it whole
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    char* argv[] = {"sh", NULL};
+    pid_t pid;
+    int ret = posix_spawn(&pid, SHELL_PATH, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    if (ret != 0) {
+        fprintf(stderr, "posix_spawn() error %d: %s\n", ret, strerror(ret));
+        close(in[1]);
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+    sh->pid = pid;
+    sh->in_fd = in[1];
+    sh->out_fd = out[0];
+    sh->err_fd = err[0];
+    sh->sentinel_len = snprintf(sh->sentinel, SENTINEL_MAX, "__AGENT_DONE_%ld_%ld_%d__", (long)pid, (long)time(NULL), rand());
+    printf("Spawned runner shell %ld\n", (long)pid);
+    return 0;
+}
+
+static char* shell_script(agentShell* sh, const char* command, size_t* script_len) {
+    size_t quotes = 0;
+    for (const char* p = command; *p; p++) quotes += (*p == '\'');
+    size_t cap = strlen(command) + quotes * 3 + sh->sentinel_len + 96;
+    char* script = malloc(cap);
+    if (!script) return NULL;
+
+    size_t len = snprintf(script, cap, "( eval '");
+    for (const char* p = command; *p; p++) {
+        if (*p == '\'') { // ' -> '\''
+            memcpy(script + len, "'\\''", 4);
+            len += 4;
+        } else {
+            script[len++] = *p;
+        }
+    }
+    len += snprintf(script + len, cap - len, "' ) </dev/null; printf '%%s%%d\\n' '%s' \"$?\"\n", sh->sentinel);
+    *script_len = len;
+    return script;
+}
+
+// 1: whole script written, 0: stdin pipe full, -1: the shell is gone (SIGPIPE is ignored)
+static int shell_feed(agentShell* sh) {
+    while (sh->script_off < sh->script_len) {
+        ssize_t n = write(sh->in_fd, sh->script + sh->script_off, sh->script_len - sh->script_off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        sh->script_off += n;
+    }
+    free(sh->script);
+    sh->script = NULL;
+    return 1;
+}
+
+static const char* find_bytes(const char* hay, size_t hay_len, const char* needle, size_t needle_len) {
+    for (size_t i = 0; i + needle_len <= hay_len; i++) {
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, needle_len) == 0) return hay + i;
+    }
+    return NULL;
+}
+
+static size_t sentinel_prefix(const char* buf, size_t have, const char* sentinel, size_t sentinel_len) {
+    size_t k = have < sentinel_len - 1 ? have : sentinel_len - 1;
+    for (; k > 0; k--) { // Longest tail of buf that could still grow into the sentinel
+        if (memcmp(buf + have - k, sentinel, k) == 0) return k;
+    }
+    return 0;
+}
+
+static agentShell* shell_idle() {
+    for (int i = 0; i < AGENT_MAX_INFLIGHT; i++) {
+        if (!shells[i].busy) return &shells[i];
+    }
+    return NULL;
+}
+
+// Forwards stderr until its pipe is empty or the outbox is full, -1 on send failure
+static int shell_drainStderr(agentShell* sh, int client_socket) {
+    char chunk[WIRE_CHUNK_SIZE];
+    while (sh->err_fd != -1 && outbox_pending() < AGENT_OUTBOX_MAX) {
+        ssize_t n = read(sh->err_fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            if (agent_sendFrame(client_socket, WIRE_OUTPUT_STDERR, sh->request_id, chunk, n) == -1) return -1;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        close(sh->err_fd); // The command closed its shell's stderr, stdout & the sentinel still work
+        sh->err_fd = -1;
+    }
+    return 0;
+}
+
+static int shell_finish(agentShell* sh, int client_socket, int status) {
+    if (sh->pid != 0 && shell_drainStderr(sh, client_socket) == -1) return -1;
+    if (send_end(client_socket, sh->request_id, status) == -1) return -1;
+    sh->busy = 0;
+    sh->out_len = 0;
+    return 0;
+}
+
+static int shell_start(agentShell* sh, int client_socket, uint32_t request_id, uint32_t timeout_ms, const char* command) {
+    sh->busy = 1;
+    sh->request_id = request_id;
+    sh->timeout_ms = timeout_ms;
+    sh->deadline = timeout_ms ? now_ms() + timeout_ms : 0;
+    sh->out_len = 0;
+    if (agent_sendFrame(client_socket, WIRE_OUTPUT_START, request_id, NULL, 0) == -1) return -1;
+
+    const char* err = "Failed to start a shell";
+    for (int attempt = 0; attempt < 2; attempt++) { // A shell that died while idle gets one replacement
+        if (sh->pid == 0 && shell_spawn(sh) == -1) break;
+        sh->script = shell_script(sh, command, &sh->script_len);
+        sh->script_off = 0;
+        if (!sh->script) {
+            err = "Out of memory";
+            break;
+        }
+        if (shell_feed(sh) != -1) return 0; // Rest of the script, if any, goes out on POLLOUT
+        shell_close(sh);
+        err = "Failed to hand the command to the shell";
+    }
+    if (send_output(client_socket, WIRE_OUTPUT_STDERR, request_id, err, strlen(err)) == -1) return -1;
+    return shell_finish(sh, client_socket, -1);
+}
+
+// Stdout readable: forward what is not the sentinel, finish the command once the status line is in
+static int shell_onStdout(agentShell* sh, int client_socket) {
+    ssize_t n = read(sh->out_fd, sh->out + sh->out_len, sizeof(sh->out) - sh->out_len);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+
+    if (n <= 0) { // The shell was killed from outside (exit & exec stay in the subshell), its status is the shell's
+        if (send_output(client_socket, WIRE_OUTPUT, sh->request_id, sh->out, sh->out_len) == -1) return -1;
+        if (shell_drainStderr(sh, client_socket) == -1) return -1;
+        return shell_finish(sh, client_socket, shell_close(sh));
+    }
+    sh->out_len += n;
+
+    const char* mark = find_bytes(sh->out, sh->out_len, sh->sentinel, sh->sentinel_len);
+    if (mark && memchr(mark + sh->sentinel_len, '\n', sh->out + sh->out_len - (mark + sh->sentinel_len))) {
+        if (send_output(client_socket, WIRE_OUTPUT, sh->request_id, sh->out, mark - sh->out) == -1) return -1;
+        return shell_finish(sh, client_socket, atoi(mark + sh->sentinel_len));
+    }
+
+    size_t out = mark ? (size_t)(mark - sh->out) : sh->out_len - sentinel_prefix(sh->out, sh->out_len, sh->sentinel, sh->sentinel_len);
+    if (out > WIRE_CHUNK_SIZE) out = WIRE_CHUNK_SIZE;
+    if (out > 0) {
+        if (agent_sendFrame(client_socket, WIRE_OUTPUT, sh->request_id, sh->out, out) == -1) return -1;
+        memmove(sh->out, sh->out + out, sh->out_len - out);
+        sh->out_len -= out;
+    }
+    return 0;
+}
+
+// Deadline passed: what stdout still holds goes out, then the shell & everything it started are killed, the next command respawns it
+static int shell_expire(agentShell* sh, int client_socket) {
+    printf("Command %u killed after %u ms\n", sh->request_id, sh->timeout_ms);
+    if (send_output(client_socket, WIRE_OUTPUT, sh->request_id, sh->out, sh->out_len) == -1) return -1;
+    if (shell_drainStderr(sh, client_socket) == -1) return -1;
+    char note[64];
+    int len = snprintf(note, sizeof(note), "Killed after its %u ms deadline", sh->timeout_ms);
+    if (agent_sendFrame(client_socket, WIRE_OUTPUT_STDERR, sh->request_id, note, len) == -1) return -1;
+    shell_close(sh);
+    return shell_finish(sh, client_socket, AGENT_KILLED_STATUS);
+}
+
+// Idle runner's pipe readable: a background job of an earlier command wrote to it, or the shell died
+static void shell_discard(agentShell* sh, int fd) {
+    char chunk[WIRE_CHUNK_SIZE];
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n > 0) {
+        printf("Dropped %zd bytes shell %ld printed between commands\n", n, (long)sh->pid);
+        return;
+    }
+    if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    shell_close(sh); // A subshell cannot close the runner's own ends, EOF means it is gone
+}
+
+static void shells_destroy() {
+    for (int i = 0; i < AGENT_MAX_INFLIGHT; i++) shell_close(&shells[i]);
+}
+
+/*
+ * AGENT LOOP:
+ * pollfd[0] IS THE SERVER SOCKET, THEN UP TO 3 PIPES PER BUSY SHELL (stdin WHILE THE SCRIPT IS PENDING, stdout, stderr)
+ * & stdout, stderr OF EVERY IDLE SHELL, WHATEVER COMES OUT OF THOSE IS DROPPED
+ * COMMANDS ALREADY IN THE RECEIVE BUFFER ARE STARTED AS SOON AS A SHELL FREES UP, BEFORE THE NEXT poll()
+ */
+static int agent_loop(int client_socket) {
+    wireBuffer inbox; // Commands may arrive split across recv() calls or several per recv()
+    wire_bufferInit(&inbox);
+    struct pollfd fds[1 + AGENT_MAX_INFLIGHT * 3];
+    agentShell* owner[1 + AGENT_MAX_INFLIGHT * 3];
+    long next_beacon = now_ms() + WIRE_BEACON_INTERVAL;
+    int ret = 0;
+
+    while (client_running && ret == 0) {
+        // Start whatever complete commands are already buffered
+        agentShell* sh;
+        wireFrame frame;
+        int next = 0;
+        while ((sh = shell_idle()) && (next = wire_nextFrame(&inbox, &frame)) == 1) {
+            if (frame.type != WIRE_COMMAND || frame.len < WIRE_DEADLINE_SIZE) {
+                fprintf(stderr, "Ignoring frame of type %u\n", frame.type);
+                continue;
+            }
+            uint32_t timeout_ms = wire_get32((const unsigned char*)frame.payload);
+            const char* command = frame.payload + WIRE_DEADLINE_SIZE;
+            printf("Received [%u] (%u ms): %s\n", frame.request_id, timeout_ms, command);
+            if (shell_start(sh, client_socket, frame.request_id, timeout_ms, command) == -1) {
+                fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+                ret = -1;
+                break;
+            }
+        }
+        if (next == -1) {
+            fprintf(stderr, "Corrupt frame from server, disconnecting\n");
+            ret = -1;
+        }
+        if (ret != 0) break;
+
+        int nfds = 1;
+        int room = outbox_pending() < AGENT_OUTBOX_MAX; // Else the shells' output waits in their pipes
+        fds[0].fd = client_socket;
+        fds[0].events = shell_idle() ? POLLIN : 0; // All shells busy: leave the commands in the kernel buffer
+        if (outbox_pending()) fds[0].events |= POLLOUT;
+        owner[0] = NULL;
+        for (int i = 0; i < AGENT_MAX_INFLIGHT; i++) {
+            sh = &shells[i];
+            if (sh->pid == 0) continue;
+            if (!sh->busy) { // Nothing of it goes to the server, read it whatever the outbox holds
+                fds[nfds] = (struct pollfd){ .fd = sh->out_fd, .events = POLLIN };
+                owner[nfds++] = sh;
+                fds[nfds] = (struct pollfd){ .fd = sh->err_fd, .events = POLLIN };
+                owner[nfds++] = sh;
+                continue;
+            }
+            if (sh->script) {
+                fds[nfds] = (struct pollfd){ .fd = sh->in_fd, .events = POLLOUT };
+                owner[nfds++] = sh;
+            }
+            if (!room) continue;
+            fds[nfds] = (struct pollfd){ .fd = sh->out_fd, .events = POLLIN };
+            owner[nfds++] = sh;
+            if (sh->err_fd != -1) {
+                fds[nfds] = (struct pollfd){ .fd = sh->err_fd, .events = POLLIN };
+                owner[nfds++] = sh;
+            }
+        }
+
+        long wake = next_beacon; // Next beacon or the earliest deadline
+        for (int i = 0; i < AGENT_MAX_INFLIGHT; i++) {
+            if (shells[i].busy && shells[i].deadline && shells[i].deadline < wake) wake = shells[i].deadline;
+        }
+        long timeout = wake - now_ms();
+        int ready = poll(fds, nfds, timeout > 0 ? (int)timeout : 0);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "poll() error %d: %s\n", ERRNO, strerror(ERRNO));
+            ret = -1;
+            break;
+        }
+
+        if (now_ms() >= next_beacon) {
+            if (agent_sendFrame(client_socket, WIRE_BEACON, 0, NULL, 0) == -1) {
+                fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+                ret = -1;
+                break;
+            }
+            next_beacon = now_ms() + WIRE_BEACON_INTERVAL;
+        }
+
+        for (int i = 1; i < nfds && ret == 0; i++) {
+            sh = owner[i];
+            if (!fds[i].revents || sh->pid == 0) continue; // Closed by an earlier entry of this round
+            if (!sh->busy) { // Idle, or finished by an earlier entry of this round: what is left is no command's output
+                shell_discard(sh, fds[i].fd);
+            } else if (fds[i].fd == sh->in_fd) {
+                if (sh->script && shell_feed(sh) == -1) { // Stdout EOF follows & reports the dead shell
+                    free(sh->script);
+                    sh->script = NULL;
+                }
+            } else if (fds[i].fd == sh->out_fd) {
+                ret = shell_onStdout(sh, client_socket);
+            } else if (fds[i].fd == sh->err_fd) {
+                ret = shell_drainStderr(sh, client_socket);
+            }
+        }
+        long now = now_ms();
+        for (int i = 0; i < AGENT_MAX_INFLIGHT && ret == 0; i++) { // After the pipes, so output already produced still goes out
+            sh = &shells[i];
+            if (sh->busy && sh->deadline && now >= sh->deadline) ret = shell_expire(sh, client_socket);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+            break;
+        }
+
+        if ((fds[0].revents & POLLOUT) && outbox_flush(client_socket) == -1) {
+            fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
+            ret = -1;
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            size_t avail;
+            char* dst = wire_bufferReserve(&inbox, wire_bufferWant(&inbox), &avail);
+            if (!dst) {
+                fprintf(stderr, "Failed to grow receive buffer\n");
+                ret = -1;
+                break;
+            }
+            int bytes_recieved = recv(client_socket, dst, (int)avail, 0);
+            if (bytes_recieved > 0) {
+                wire_bufferCommit(&inbox, bytes_recieved);
+            } else if (bytes_recieved == 0) {
+                printf("Received nothing from server and/or server disconnected\n");
+                printf("Disconnecting & closing socket...\n");
+                break;
+            } else if (ERRNO != EINTR && ERRNO != EAGAIN && ERRNO != EWOULDBLOCK) {
+                fprintf(stderr, "recv() error %d: %s\n", ERRNO, strerror(ERRNO));
+                ret = -1;
+            }
+        }
+    }
+
+    wire_bufferFree(&inbox);
+    shells_destroy();
+    free(outbox.data);
+    outbox = (agentOutbox){0};
+    return ret;
+}
+#endif
+
+#ifdef _WIN32
+/*
+ * WINDOWS AGENT LOOP:
+ * BLOCKING recv(), COMMANDS RUN ONE AFTER ANOTHER THROUGH popen(), NO BEACONS, NO DEADLINES
+ */
+static int agent_loop(int client_socket) {
+    wireBuffer inbox; // Commands may arrive split across recv() calls or several per recv()
+    wire_bufferInit(&inbox);
+    int ret = 0;
+
+    while(client_running && ret == 0) {
+        printf("Waiting for commands...\n");
+        size_t avail;
+        char* dst = wire_bufferReserve(&inbox, wire_bufferWant(&inbox), &avail);
+        if (!dst) {
+            fprintf(stderr, "Failed to grow receive buffer\n");
+            break;
+        }
+        int bytes_recieved = recv(client_socket, dst, (int)avail, 0);
+
+        printf("recv() returned: %d\n", bytes_recieved);
+        if (bytes_recieved > 0) {
+            wire_bufferCommit(&inbox, bytes_recieved);
+            wireFrame frame;
+            int next;
+            while ((next = wire_nextFrame(&inbox, &frame)) == 1) {
+                if (frame.type != WIRE_COMMAND || frame.len < WIRE_DEADLINE_SIZE) {
+                    fprintf(stderr, "Ignoring frame of type %u\n", frame.type);
+                    continue;
+                }
+                const char* command = frame.payload + WIRE_DEADLINE_SIZE; // No deadline here, popen() cannot be interrupted
+                printf("Received [%u]: %s\n", frame.request_id, command);
+                if (run_command(client_socket, frame.request_id, command) != 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            if (next == -1) {
+                fprintf(stderr, "Corrupt frame from server, disconnecting\n");
+                ret = -1;
+            }
+        } else if (bytes_recieved == 0) {
+            printf("Received nothing from server and/or server disconnected\n");
+            printf("Disconnecting & closing socket...\n");
+            break;
+        } else {
+            fprintf(stderr, "recv() error %d: %s", ERRNO, strerror(ERRNO));
+            ret = -1;
+        }
+    }
+
+    wire_bufferFree(&inbox);
+    return ret;
+}
+#endif
+
 int main() {
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    #ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // A shell dying mid-write must not kill the agent
+    #endif
 
     #ifdef _WIN32
         WSADATA wsaData;
@@ -34,6 +678,9 @@ int main() {
         fprintf(stderr, "Socket() error %d: %s\n", ERRNO, strerror(ERRNO));
         return 1;
     }
+    #ifndef _WIN32
+    fcntl(client_socket, F_SETFD, FD_CLOEXEC); // The shells must not keep the connection open
+    #endif
 
     //Initializing server address
     struct sockaddr_in serverAddr;
@@ -60,80 +707,11 @@ int main() {
     }
 
     printf("Connected to %s : %d\n", SERVER_IP, SERVER_PORT);
+    #ifndef _WIN32
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK); // agent_loop() never blocks on the server
+    #endif
 
-    while(client_running) {
-        printf("Waiting for commands...\n");
-        char recvBuffer[BUFFER_SIZE];
-        ssize_t bytes_recieved = recv(client_socket, recvBuffer, BUFFER_SIZE - 1, 0);
-
-        printf("recv() returned: %zd\n", bytes_recieved);
-        if (bytes_recieved > 0) {
-            recvBuffer[bytes_recieved] = '\0';
-            printf("Received: %s\n", recvBuffer);
-
-            /*
-             * HERE LIES COMMAND EXECUTION AND SENDING BACK OUTPUT
-             * PRIVILEGE ESCALATION SHOULD BE REMEMBERED, MUST BE IMPLEMENTED TO RUN CERTAIN COMMANDS ON CLIENT MACHINE
-             *
-             * note: Popen() is a high level abstraction, pipe(), fork(), and exec() can be used in cases such as:
-             *      Executing a command as a different user (requires careful privilege management).
-             *      Performing more complex process management.
-             */
-
-            FILE *fp = popen(recvBuffer, "r"); // Execute command, read output
-            if (fp == NULL) {
-                char err[BUFFER_SIZE];
-                snprintf(err, sizeof(err), "popen() failed: %s", strerror(ERRNO));
-                if (send(client_socket, err, strlen(err) + 1, 0) == -1) { // Send popen() failure error message to server
-                    perror("send() failed");
-                    break;
-                }
-                continue; // Continue to next command
-            }
-
-            // Get command output from file pipe
-            char output_buffer[BUFFER_SIZE];
-            size_t output_len = 0;
-
-            /*
-             * There's a small possibility of a buffer overflow in the following while loop if the command produces an extremely large amount of output. The BUFFER_SIZE might be reached * before the fgets loop has a chance to exit due to reaching the end of the file.
-             */
-
-            while (fgets(output_buffer + output_len, BUFFER_SIZE - output_len, fp) != NULL) {
-                output_len += strlen(output_buffer + output_len);
-                if (output_len >= BUFFER_SIZE-1) {
-                    printf("Large command output, buffer overflow, output truncated");
-                    break; // prevent buffer overflow
-                }
-            }
-            if (output_len == 0) { // Check if no output was read
-                const char *no_output_message = "No output from command. (or command unrecognized)"; // Send a "no output" message
-                send(client_socket, no_output_message, strlen(no_output_message) + 1, 0); // +1 for null terminator
-            } else {
-                printf("About to send %zu bytes: %s\n", output_len, output_buffer);
-
-                // Send the output back to the server
-                if (send(client_socket, output_buffer, output_len, 0) == -1) {
-                    fprintf(stderr, "send() error %d: %s\n", ERRNO, strerror(ERRNO));
-                    break;
-                }
-            }
-
-            if (pclose(fp) == -1) {
-                fprintf(stderr, "pclose() failed: %d\n", ERRNO);
-            }
-
-
-
-        } else if (bytes_recieved == 0) {
-            printf("Received nothing from server and/or server disconnected\n");
-            printf("Disconnecting & closing socket...\n");
-            break;
-        } else {
-            fprintf(stderr, "recv() error %d: %s", ERRNO, strerror(ERRNO));
-            break;
-        }
-    }
+    agent_loop(client_socket);
 
     close(client_socket);
     #ifdef _WIN32
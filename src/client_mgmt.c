@@ -1,219 +1,256 @@
 #include "common.h"
 #include "client_mgmt.h"
+#include "pool.h"
+#include "ebr.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <time.h>
-#include <sys/time.h>
-
-// Define the global mutexes and condition variable
-pthread_mutex_t hash_mutex;
-pthread_mutex_t queue_mutex;
-pthread_cond_t queue_cond;
-
-hashMap* clientHash;
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+slotTable* clientSlots;
+
+static pool client_pool = POOL_INITIALIZER("client", sizeof(client));
+static pool queueNode_pool = POOL_INITIALIZER("queueNode", sizeof(queueNode));
+
+/*
+ *
+ * CLIENT SLOTS:
+ * EVERY CONNECTED AGENT LIVES IN A SLOT, ITS clientHandle IS THE SLOT INDEX + THE SLOT'S GENERATION
+ *
+ *      LOOKUP = ONE CHUNK INDEX, ONE SLOT INDEX & A GENERATION COMPARE, NO HASHING, NO strcmp
+ *      FREEING A SLOT BUMPS ITS GENERATION, SO A STALE HANDLE FROM A DISCONNECTED AGENT NEVER MATCHES
+ *      FREED SLOTS ARE REUSED IN FIFO ORDER TO DELAY GENERATION WRAP-AROUND ON ANY ONE SLOT
+ *
+ * READERS (slot_grab, slot_forEach) TAKE NO LOCK:
+ *      CHUNKS ARE NEVER MOVED OR FREED BEFORE SHUTDOWN, THE CLIENT POINTER IS READ INSIDE AN EBR CRITICAL SECTION
+ *      slot_grab ONLY RETURNS A CLIENT IT MANAGED TO TAKE A REFERENCE ON
+ *
+ * WRITERS (slot_put, slot_remove) SERIALIZE ON ONE MUTEX, BOTH ARE O(1)
+ *
+ * CHANGE LOG:
+ *      EVERY WRITE BUMPS table->version & RECORDS AN ADDED/REMOVED EVENT IN A RING OF REGISTRY_LOG_SIZE
+ *      THE FRONTEND IS SENT THE EVENTS IT HAS NOT SEEN YET (slot_logRead), NEVER THE WHOLE TABLE AGAIN
+ *      A READER THE RING LAPPED GETS -1 & FALLS BACK TO A SNAPSHOT
+ *
+ */
+
+static clientSlot* slot_get(slotTable* table, uint32_t index) {
+    clientSlot* chunk = atomic_load_explicit(&table->chunks[index >> SLOT_CHUNK_SHIFT], memory_order_acquire);
+    return chunk ? &chunk[index & (SLOT_CHUNK_SIZE - 1)] : NULL;
+}
 
-void init_mutexes() {
-    if (pthread_mutex_init(&hash_mutex, NULL) != 0) {
-        perror("[ERROR] hash_mutex init failed\n");
-        exit(1);
-    }
-    if (pthread_mutex_init(&queue_mutex, NULL) != 0) {
-        perror("[ERROR] queue_mutex init failed\n");
-        exit(1);
-    }
-    if (pthread_cond_init(&queue_cond, NULL) != 0) {
-        perror("[ERROR] queue_cond init failed\n");
+slotTable* slot_init() {
+    slotTable* table = malloc(sizeof(slotTable));
+    if (table == NULL) return NULL;
+
+    for (uint32_t i = 0; i < SLOT_MAX_CHUNKS; i++) atomic_init(&table->chunks[i], NULL);
+    atomic_init(&table->used, 0);
+    table->free_head = SLOT_NONE;
+    table->free_tail = SLOT_NONE;
+    atomic_init(&table->count, 0);
+    table->version = 0;
+    if (pthread_mutex_init(&table->mutex, NULL) != 0) {
+        perror("[ERROR] slot table mutex init failed\n");
         exit(1);
     }
+    return table;
 }
 
-void destroy_mutexes() {
-    pthread_mutex_destroy(&hash_mutex);
-    pthread_mutex_destroy(&queue_mutex);
-    pthread_cond_destroy(&queue_cond);
+int client_formatId(clientHandle handle, char* buffer, size_t size) {
+    return snprintf(buffer, size, CLIENT_ID_FMT, handle);
 }
 
+clientHandle client_parseId(const char* id) {
+    size_t prefix = strlen(CLIENT_ID_PREFIX);
+    if (!id || strncmp(id, CLIENT_ID_PREFIX, prefix) != 0 || id[prefix] == '\0') return 0;
 
-
-hashMap* hash_init(int size) {
-    hashMap* map = malloc(sizeof(hashMap));
-    if (map == NULL) return NULL;
-
-    pthread_mutex_lock(&hash_mutex);
-    map->size = size;
-    map->buckets = malloc(size * sizeof(Node*));
-    if (map->buckets == NULL) {
-        pthread_mutex_unlock(&hash_mutex);
-        free(map);
-        return NULL;
+    uint64_t handle = 0;
+    for (const char* p = id + prefix; *p; p++) {
+        if (*p < '0' || *p > '9') return 0;
+        handle = handle * 10 + (*p - '0');
+        if (handle > UINT32_MAX) return 0;
     }
-
-    for (int i = 0; i < size; i++) map->buckets[i] = NULL;
-    pthread_mutex_unlock(&hash_mutex);
-    return map;
+    return (clientHandle)handle;
 }
 
-int id_isValid(char* id) {
-    char enforced[3] = "cli";
-    if (strlen(id) < 4) return 0;
+static void slot_log(slotTable* table, enum REGISTRY_EVENT_TYPE type, client* cli) { // Mutex held
+    registryEvent* ev = &table->log[++table->version % REGISTRY_LOG_SIZE];
+    ev->version = table->version;
+    ev->type = type;
+    ev->handle = cli->handle;
+    if (type == REGISTRY_REMOVED) ev->ip[0] = '\0';
+    else snprintf(ev->ip, sizeof(ev->ip), "%s", cli->ip);
+}
 
-    for (int i = 0; i < 3; i++) {
-        if (id[i] != enforced[i]) return 0;
+static uint32_t slot_claim(slotTable* table) { // Mutex held
+    if (table->free_head != SLOT_NONE) {
+        uint32_t index = table->free_head;
+        table->free_head = slot_get(table, index)->next_free;
+        if (table->free_head == SLOT_NONE) table->free_tail = SLOT_NONE;
+        return index;
     }
-    return 1;
-}
 
-unsigned int hash_func(char* id, int mapsize) {
-    unsigned int key = 'c' + 'l' + 'i';
-    if (!id_isValid(id)) return UINT_MAX; // Use UINT_MAX instead of -1 for unsigned
-    for (int i = 3; id[i] != '\0'; i++) key += id[i];
-    key = key % mapsize;
-    return key;
+    uint32_t index = atomic_load_explicit(&table->used, memory_order_relaxed);
+    if (index == CLIENT_MAX_SLOTS) return SLOT_NONE;
+    uint32_t c = index >> SLOT_CHUNK_SHIFT;
+    if (atomic_load_explicit(&table->chunks[c], memory_order_relaxed) == NULL) {
+        clientSlot* chunk = malloc(SLOT_CHUNK_SIZE * sizeof(clientSlot));
+        if (chunk == NULL) return SLOT_NONE;
+        for (uint32_t i = 0; i < SLOT_CHUNK_SIZE; i++) {
+            atomic_init(&chunk[i].cli, NULL);
+            atomic_init(&chunk[i].gen, 1);
+            chunk[i].next_free = SLOT_NONE;
+        }
+        atomic_store_explicit(&table->chunks[c], chunk, memory_order_release);
+    }
+    atomic_store_explicit(&table->used, index + 1, memory_order_release);
+    return index;
 }
 
-Node* hash_createNode(client* c) {
-    Node* node = (Node*)malloc(sizeof(struct Node));
-    if (node == NULL) return NULL;
-    node->next = NULL;
-    node->client = c;
-    return node;
+clientHandle slot_put(slotTable* table, client* cli) {
+    pthread_mutex_lock(&table->mutex);
+    uint32_t index = slot_claim(table);
+    if (index == SLOT_NONE) {
+        pthread_mutex_unlock(&table->mutex);
+        fprintf(stderr, "[ERROR] slot_put : No free client slot\n");
+        return 0;
+    }
+    clientSlot* slot = slot_get(table, index);
+    cli->handle = (atomic_load_explicit(&slot->gen, memory_order_relaxed) << CLIENT_INDEX_BITS) | index;
+    client_acquire(cli); // clientSlots' reference, dropped by slot_remove()
+    atomic_store_explicit(&slot->cli, cli, memory_order_release);
+    atomic_fetch_add(&table->count, 1);
+    slot_log(table, REGISTRY_ADDED, cli);
+    pthread_mutex_unlock(&table->mutex);
+
+    printf("slot_put : Added " CLIENT_ID_FMT " to clientSlots at slot %u\n", cli->handle, index);
+    return cli->handle;
 }
 
-void linkedList_add(Node* array, Node* node) {
-    if (array == NULL) {
-        printf("[ERROR] linkedList_add: Node* array (bucket) is NULL, failure at mem allocation\n");
-        return;
+int slot_remove(slotTable* table, clientHandle handle) {
+    uint32_t index = handle & (CLIENT_MAX_SLOTS - 1);
+    pthread_mutex_lock(&table->mutex);
+    clientSlot* slot = index < atomic_load_explicit(&table->used, memory_order_relaxed) ? slot_get(table, index) : NULL;
+    client* cli = slot ? atomic_load_explicit(&slot->cli, memory_order_relaxed) : NULL;
+    if (!cli || cli->handle != handle) {
+        pthread_mutex_unlock(&table->mutex);
+        return -1;
     }
-    Node* p = array;
+    atomic_store_explicit(&slot->cli, NULL, memory_order_release);
+    uint32_t gen = (atomic_load_explicit(&slot->gen, memory_order_relaxed) + 1) & CLIENT_GEN_MASK;
+    atomic_store_explicit(&slot->gen, gen ? gen : 1, memory_order_release); // Generation 0 would allow handle 0
+    slot->next_free = SLOT_NONE;
+    if (table->free_tail == SLOT_NONE) table->free_head = index;
+    else slot_get(table, table->free_tail)->next_free = index;
+    table->free_tail = index;
+    atomic_fetch_sub(&table->count, 1);
+    slot_log(table, REGISTRY_REMOVED, cli);
+    pthread_mutex_unlock(&table->mutex);
+
+    client_release(cli);
+    return 0;
+}
 
-    while (p->next != NULL) p = p->next;
 
-    if (!p) {
-        printf("[ERROR] linkedList_add : Unexpected: p is NULL after traversal\n");
-        return;
-    }
+client* slot_grab(slotTable* table, clientHandle handle) {
+    uint32_t index = handle & (CLIENT_MAX_SLOTS - 1);
+    if (index >= atomic_load_explicit(&table->used, memory_order_acquire)) return NULL;
+    clientSlot* slot = slot_get(table, index);
+    if (atomic_load_explicit(&slot->gen, memory_order_acquire) != handle >> CLIENT_INDEX_BITS)
+        return NULL; // Stale handle, rejected without touching the client
 
-    p->next = node;
+    client* found = NULL;
+    ebr_enter();
+    client* cli = atomic_load_explicit(&slot->cli, memory_order_acquire);
+    if (cli && cli->handle == handle && client_tryAcquire(cli)) found = cli;
+    ebr_exit();
+    return found; // NULL if not found or already on its way out
 }
 
-int hash_put(hashMap* hash, client* client) {
-    unsigned int key = hash_func(client->id, hash->size);
-    if (key == UINT_MAX) return -1;
-
-    Node* newNode = hash_createNode(client);
-    if (newNode == NULL) {
-        fprintf(stderr, "[ERROR] hash_put : Failed to create  new hash node\n");
-        return -1;
+void slot_forEach(slotTable* table, void (*fn)(client* cli, void* arg), void* arg) {
+    ebr_enter();
+    uint32_t used = atomic_load_explicit(&table->used, memory_order_acquire);
+    for (uint32_t i = 0; i < used; i++) {
+        client* cli = atomic_load_explicit(&slot_get(table, i)->cli, memory_order_acquire);
+        if (cli) fn(cli, arg);
     }
-    pthread_mutex_lock(&hash_mutex);
-    if (hash->buckets[key] == NULL) {
-        hash->buckets[key] = newNode; // Initialize the bucket with the first node
-    } else {
-        linkedList_add(hash->buckets[key], newNode); // Append to existing list
-    }
-    printf("hash_put : Added %s to clientHash at bucket %u\n", client->id, key);
-    pthread_mutex_unlock(&hash_mutex);
-    return 1;
+    ebr_exit();
 }
 
-void delete_client(client* cli) {
-    queue_destroy(cli->command_queue);
-    cli->command_queue = NULL;
-    free(cli->id);
-    cli->id = NULL;
-    free(cli->ip);
-    cli->ip = NULL;
-    free(cli);
+uint64_t slot_version(slotTable* table) {
+    pthread_mutex_lock(&table->mutex);
+    uint64_t version = table->version;
+    pthread_mutex_unlock(&table->mutex);
+    return version;
 }
 
-
-int hash_remove(hashMap* hash, char* id) {
-    unsigned int key = hash_func(id, hash->size);
-    if (key == UINT_MAX) return -1;
-    pthread_mutex_lock(&hash_mutex);
-    Node* prev = NULL;
-    Node* p = hash->buckets[key];
-    for (; p && strcmp(p->client->id, id); prev = p, p = p->next);
-    if (!p) {
-        pthread_mutex_unlock(&hash_mutex);
+int slot_logRead(slotTable* table, uint64_t after, registryEvent* out, int max) {
+    pthread_mutex_lock(&table->mutex);
+    if (table->version - after > REGISTRY_LOG_SIZE) { // Lapped, the reader needs a snapshot
+        pthread_mutex_unlock(&table->mutex);
         return -1;
     }
-    if (prev) prev->next = p->next;
-    else hash->buckets[key] = p->next;
-    delete_client(p->client);
-    free(p);
-    pthread_mutex_unlock(&hash_mutex);
-    return 0;
+    int n = 0;
+    for (uint64_t v = after + 1; v <= table->version && n < max; v++)
+        out[n++] = table->log[v % REGISTRY_LOG_SIZE];
+    pthread_mutex_unlock(&table->mutex);
+    return n;
 }
 
-
-client* hash_grab(hashMap* hash, char* id) {
-    int key = hash_func(id, HASH_SIZE);
-    pthread_mutex_lock(&hash_mutex);
-    Node* n = hash->buckets[key];
-    while (n != NULL) {
-        if (strcmp(n->client->id, id) == 0) {
-            client* cl = n->client;
-            pthread_mutex_unlock(&hash_mutex);
-            return cl;
-        }
-        n = n->next;
-    }
-    pthread_mutex_unlock(&hash_mutex);
-    return NULL; // Client not found
-}
-
-void hash_destroy(hashMap* hash) {
-    pthread_mutex_lock(&hash_mutex);
-    for (int i = 0; i < hash->size; i++) {
-        Node* listHead = hash->buckets[i];
-        Node* p = NULL;
-        while(listHead != NULL) {
-            free(listHead->client->id);
-            free(listHead->client->ip);
-            free(listHead->client);
-            p = listHead;
-            listHead = listHead->next;
-            free(p);
-            p = NULL; // against dangling pointer
-        }
+void slot_destroy(slotTable* table) { // Shutdown only, every other thread is gone
+    uint32_t used = atomic_load(&table->used);
+    for (uint32_t i = 0; i < used; i++) {
+        client* cli = atomic_load(&slot_get(table, i)->cli);
+        if (cli) delete_client(cli);
     }
-    free(hash->buckets);
-    pthread_mutex_unlock(&hash_mutex);
+    for (uint32_t c = 0; c < SLOT_MAX_CHUNKS; c++) free(atomic_load(&table->chunks[c]));
+    pthread_mutex_destroy(&table->mutex);
 }
 
 
 void queue_init(Queue* q) {
-    pthread_mutex_lock(&queue_mutex);
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
-    pthread_mutex_unlock(&queue_mutex);
+    if (pthread_mutex_init(&q->mutex, NULL) != 0) {
+        perror("[ERROR] queue mutex init failed\n");
+        exit(1);
+    }
+    q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->event_fd == -1) {
+        perror("[ERROR] queue eventfd init failed\n");
+        exit(1);
+    }
+}
+
+void queue_ackEvent(Queue* q) {
+    uint64_t v;
+    if (read(q->event_fd, &v, sizeof(v)) == -1 && ERRNO != EAGAIN)
+        fprintf(stderr, "[ERROR] queue_ackEvent : read() on event_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
 }
 
-queueNode* queue_createNode(char* output) {
-    queueNode* node = malloc(sizeof(queueNode));
+queueNode* queue_createNode(char* buffer, size_t len) {
+    queueNode* node = pool_alloc(&queueNode_pool);
     if (!node) {
         printf("[ERROR] queue_createNode malloc failure\n");
-        return NULL;
+        return NULL; // Caller keeps ownership of buffer
     }
     node->next = NULL;
-    node->bffr = malloc(strlen(output) + 1);
-    if (!node->bffr) {
-        printf("[ERROR] queue_createNode : new_queueNode-->output malloc error\n");
-        node->bffr = NULL;
-        free(node);
-        return NULL;
-    }
-    strcpy(node->bffr, output);
+    node->bffr = buffer; // Owned by the node from now on, no copy
+    node->len = len;
     return node;
 }
 
+void queue_deleteNode(queueNode* node) {
+    pool_bufFree(node->bffr);
+    pool_free(&queueNode_pool, node);
+}
+
 int queue_isEmpty(Queue* q) {
-    pthread_mutex_lock(&queue_mutex);
+    pthread_mutex_lock(&q->mutex);
     int b = !(q->size);
-    pthread_mutex_unlock(&queue_mutex);
+    pthread_mutex_unlock(&q->mutex);
     return b;
 }
 
@@ -223,7 +260,7 @@ int queue_push(Queue* q, queueNode* qN) {
         return 1;
     }
     int succ = 0;
-    pthread_mutex_lock(&queue_mutex);
+    pthread_mutex_lock(&q->mutex);
     if (q->size != 0 && q->tail != NULL) {
         q->tail->next = qN;
         q->tail = qN;
@@ -235,86 +272,55 @@ int queue_push(Queue* q, queueNode* qN) {
     } else {
         printf("[ERROR] queue_push : Unable to push your queueNode. Current queue-->tail is NULL & queue is NOT empty; error\n");
     }
-    succ ? printf("Pushed to queue: %s, new queue size: %d\n", qN->bffr, ++q->size) : printf("Failed to push queue");
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+    if (succ) q->size++; // No printf under the lock, stdout's own lock would serialize every queue again
+    if (succ && q->size == 1) { // Empty -> non-empty, wake whoever waits on event_fd
+        uint64_t one = 1;
+        if (write(q->event_fd, &one, sizeof(one)) == -1)
+            fprintf(stderr, "[ERROR] queue_push : write() on event_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+    }
+    pthread_mutex_unlock(&q->mutex);
     return 0;
 }
 
-char* queue_pop(Queue* q) {
-    pthread_mutex_lock(&queue_mutex);
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0) {
-        perror("gettimeofday failed");
-        pthread_mutex_unlock(&queue_mutex);
-        return NULL;
+char* queue_pop(Queue* q, size_t* len) {
+    pthread_mutex_lock(&q->mutex);
+    if (q->head == NULL) {
+        pthread_mutex_unlock(&q->mutex);
+        return NULL; // Empty, wait on q->event_fd instead of polling
     }
 
-    struct timespec ts;
-    ts.tv_sec = tv.tv_sec;
-    long long nsec = (long long)tv.tv_usec * 1000 + 5000000; // 5ms in nanoseconds
-    if (nsec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000) {
-        fprintf(stderr, "Invalid tv.tv_usec: %ld\n", tv.tv_usec);
-        nsec = 5000000; // Fallback to 5ms
-        ts.tv_sec = time(NULL); // Fallback to current time
-    }
-    ts.tv_nsec = nsec % 1000000000;
-    ts.tv_sec += nsec / 1000000000;
-
-    //printf("queue_pop : ts.tv_sec=%ld, ts.tv_nsec=%ld\n", ts.tv_sec, ts.tv_nsec); // Debug
-
-    while (q->head == NULL) {
-        int result = pthread_cond_timedwait(&queue_cond, &queue_mutex, &ts);
-        if (result == ETIMEDOUT) {
-            pthread_mutex_unlock(&queue_mutex);
-            return NULL; // Timeout, no message
-        }
-        if (result != 0) {
-            fprintf(stderr, "[ERROR] pthread_cond_timedwait failed: %d\n", result);
-            pthread_mutex_unlock(&queue_mutex);
-            return NULL;
-        }
-    }
-
-    char* output = malloc(strlen(q->head->bffr) + 1);
-    if (!output) {
-        perror("[ERROR] malloc output in queue_pop failed\n");
-        pthread_mutex_unlock(&queue_mutex);
-        return NULL;
-    }
-    strcpy(output, q->head->bffr);
     queueNode* oldhead = q->head;
     q->head = q->head->next;
     if (q->head == NULL) q->tail = NULL;
     q->size--;
-    free(oldhead->bffr);
-    free(oldhead);
-    pthread_mutex_unlock(&queue_mutex);
+    pthread_mutex_unlock(&q->mutex);
+
+    char* output = oldhead->bffr; // Ownership goes back to the caller, same buffer that was pushed
+    if (len) *len = oldhead->len;
+    pool_free(&queueNode_pool, oldhead);
     return output;
 }
 
 void queue_destroy(Queue* q) {
-    char* output;
     queueNode* p = q->head;
-    queueNode* p2 = q->head;
-    for(int i = 0; i < q->size; i++) {
-        output = queue_pop(q);
-        free(output);
-        p = p2;
-        p2 = p->next;
-        free(p);
+    while (p != NULL) {
+        queueNode* next = p->next;
+        queue_deleteNode(p);
+        p = next;
     }
+    pthread_mutex_destroy(&q->mutex);
+    close(q->event_fd);
     free(q);
 }
 
 
 
-client* createClient(int socket_desc, char* ip, int* currClient_ID) {
+client* createClient(int socket_desc, char* ip) {
 
-    client* newClient = malloc(sizeof(client));
+    client* newClient = pool_alloc(&client_pool);
     if (!newClient) {
         fprintf(stderr, "[ERROR] [client_mgmt/createClient] Error allocating memory for client struct\n");
-        free(ip);
+        pool_bufFree(ip);
         close(socket_desc);
         #ifdef _WIN32
         WSACleanup();
@@ -323,21 +329,12 @@ client* createClient(int socket_desc, char* ip, int* currClient_ID) {
     }
     newClient->ip = ip;
     newClient->socket_desc = socket_desc;
-
-    char* id = malloc(10);
-    if (!id) {
-        fprintf(stderr, "[ERROR] [client_mgmt/createClient] Error allocating memory for client ID\n");
-        free(newClient);
-        free(ip);
-        close(socket_desc);
-        #ifdef _WIN32
-        WSACleanup();
-        #endif
-        return NULL;
-    }
-    strncpy(id, "cli", 3);
-    snprintf(id + 3, 7, "%d", ++(*currClient_ID));
-    newClient->id = id;
+    newClient->write_fd = -1; // Until reactor_add()
+    newClient->handle = 0; // Until slot_put()
+    wire_bufferInit(&newClient->inbox);
+    newClient->unsent = NULL;
+    newClient->unsent_len = 0;
+    newClient->unsent_off = 0;
 
     Queue* cmd_queue = malloc(sizeof(Queue));
     if (!cmd_queue) {
@@ -346,6 +343,66 @@ client* createClient(int socket_desc, char* ip, int* currClient_ID) {
     queue_init(cmd_queue);
 
     newClient->command_queue = cmd_queue;
+    atomic_init(&newClient->refcount, 1);
+    atomic_init(&newClient->closed, 0);
+    newClient->reactor_next = NULL;
+    atomic_init(&newClient->last_seen, wheel_now());
+    wheel_nodeInit(&newClient->live_timer, NULL); // Armed by the server once the client is registered
+    newClient->pending = NULL;
+    pthread_mutex_init(&newClient->pending_mutex, NULL);
 
     return newClient;
 }
+
+/*
+ *
+ * CLIENT LIFETIME:
+ * EVERY HOLDER OF A client* OUTSIDE AN EBR CRITICAL SECTION OWNS A REFERENCE
+ *
+ *      THE LAST client_release() CLOSES THE SOCKET & DESTROYS THE COMMAND QUEUE RIGHT AWAY
+ *      ip & THE STRUCT ITSELF ARE RETIRED, LOCK-FREE READERS MAY STILL BE CHECKING handle
+ *
+ */
+
+static void client_reclaim(void* obj) {
+    client* cli = obj;
+    pool_bufFree(cli->ip);
+    pool_free(&client_pool, cli);
+}
+
+static void client_teardown(client* cli) {
+    queue_destroy(cli->command_queue);
+    cli->command_queue = NULL;
+    close(cli->socket_desc);
+    cli->socket_desc = -1;
+    if (cli->write_fd != -1) close(cli->write_fd);
+    cli->write_fd = -1;
+    wire_bufferFree(&cli->inbox);
+    pool_bufFree(cli->unsent);
+    cli->unsent = NULL;
+    pthread_mutex_destroy(&cli->pending_mutex); // Every pendingCommand held a reference, none is left
+}
+
+void client_acquire(client* cli) {
+    atomic_fetch_add_explicit(&cli->refcount, 1, memory_order_relaxed);
+}
+
+int client_tryAcquire(client* cli) {
+    int refs = atomic_load_explicit(&cli->refcount, memory_order_relaxed);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak_explicit(&cli->refcount, &refs, refs + 1, memory_order_acquire, memory_order_relaxed))
+            return 1;
+    }
+    return 0;
+}
+
+void client_release(client* cli) {
+    if (atomic_fetch_sub_explicit(&cli->refcount, 1, memory_order_acq_rel) != 1) return;
+    client_teardown(cli);
+    ebr_retire(cli, client_reclaim);
+}
+
+void delete_client(client* cli) {
+    client_teardown(cli);
+    client_reclaim(cli);
+}
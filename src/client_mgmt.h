@@ -6,24 +6,31 @@
 #define CLIENT_MGMT
 
 #include "common.h"
+#include "wire.h"
+#include "timerwheel.h"
 
-#define HASH_SIZE 100
+#include <stdint.h>
+#include <stdatomic.h>
 
-extern pthread_mutex_t hash_mutex;
+#define CLIENT_INDEX_BITS 20 // Low bits of a clientHandle: slot index
+#define CLIENT_GEN_MASK 0xFFFu // High 12 bits: slot generation, bumped every time the slot is freed
+#define CLIENT_MAX_SLOTS (1u << CLIENT_INDEX_BITS)
+#define SLOT_CHUNK_SHIFT 10 // 1024 slots per chunk, chunks are allocated on demand & never move
+#define SLOT_CHUNK_SIZE (1u << SLOT_CHUNK_SHIFT)
+#define SLOT_MAX_CHUNKS (CLIENT_MAX_SLOTS / SLOT_CHUNK_SIZE)
+#define SLOT_NONE UINT32_MAX // End of the free list
 
-extern pthread_mutex_t queue_mutex;
+#define CLIENT_ID_PREFIX "cli" // Text form of a handle, JSON boundary only: cli<handle>
+#define CLIENT_ID_FMT CLIENT_ID_PREFIX "%u"
+#define CLIENT_ID_MAX 16 // "cli" + 10 digits + '\0'
 
-extern pthread_cond_t queue_cond;
-
-
-void init_mutexes();
-
-void destroy_mutexes();
+#define REGISTRY_LOG_SIZE 4096 // Change log entries kept, a reader further behind than that resyncs from a snapshot
 
 /* * * * * * * * * * * * * * * * * */
 
 typedef struct queueNode {
-    char* bffr;
+    char* bffr; // Owned by the node while queued, handed back as-is by queue_pop
+    size_t len;
     struct queueNode* next;
 } queueNode;
 
@@ -31,51 +38,95 @@ typedef struct queue {
     queueNode* head;
     queueNode* tail;
     int size;
+    pthread_mutex_t mutex; // Per queue, producers/consumers of different queues never contend
+    int event_fd; // eventfd, readable once the queue goes from empty to non-empty
 } Queue;
 
 /* * * * * * * * * * * * * * * * * */
 
+typedef uint32_t clientHandle; // generation << CLIENT_INDEX_BITS | slot index, 0 is never valid
+
+struct pendingCommand; // protocolhandler.h
+
 typedef struct client {
-    int socket_desc;
+    int socket_desc; // O_NONBLOCK
+    int write_fd; // dup() of socket_desc, its own epoll registration waits for EPOLLOUT while unsent is stuck
     char* ip;
-    char* id; // eg: cli1, cli2
-    Queue* command_queue;
-    #ifdef _WIN32
-    HANDLE thread;
-    #else
-    pthread_t thread;
-    #endif
+    clientHandle handle; // Set by slot_put()
+    Queue* command_queue; // Holds complete wire frames
+    wireBuffer inbox; // Reassembles the agent's frames, only touched by the worker running on_readable
+    char* unsent; // Wire frame the socket only took part of, only touched by the worker running on_writable
+    size_t unsent_len;
+    size_t unsent_off; // Bytes of unsent already sent
+    atomic_int refcount; // clientSlots, the reactor, in-flight jobs & slot_grab() callers each hold one
+    atomic_int closed; // Set once by disconnect_client()
+    struct client* reactor_next; // Parked by reactor_remove() until the epoll loop drops its reference
+    atomic_uint_fast64_t last_seen; // wheel_now() of the last bytes received from the agent
+    timerNode live_timer; // Silence deadline, holds a reference while scheduled
+    struct pendingCommand* pending; // Commands sent & not finished yet, each with its deadline
+    pthread_mutex_t pending_mutex; // Taken before the wheel's mutex, never the other way around
 } client;
 
-client* createClient(int socket_desc, char* ip, int* currClient_ID);
+client* createClient(int socket_desc, char* ip); // Returned with one reference, owned by the caller
 
-typedef struct Node {
-    struct Node* next;
-    client* client;
-} Node;
+void client_acquire(client* cli); // Caller must already hold a reference
 
-typedef struct hashMap {
-    int size;
-    Node** buckets;
-} hashMap;
+int client_tryAcquire(client* cli); // 0 if the client is already being reclaimed
+
+void client_release(client* cli); // Last reference closes the socket & queue, memory goes through ebr_retire()
+
+void delete_client(client* cli); // Immediate teardown, only once no other thread can reach the client
 
-extern hashMap* clientHash;
+int client_formatId(clientHandle handle, char* buffer, size_t size); // "cli<handle>", snprintf semantics
 
-hashMap* hash_init(int size);
+clientHandle client_parseId(const char* id); // 0 unless id is "cli" followed by a handle's digits
 
-unsigned int hash_func(char* id, int mapsize);
+typedef struct clientSlot {
+    _Atomic(client*) cli; // NULL while free
+    atomic_uint gen; // Generation of the current (or next) occupant
+    uint32_t next_free;
+} clientSlot;
 
-Node* hash_createNode(client* c);
+enum REGISTRY_EVENT_TYPE { // No "changed": a client's ip is fixed for the life of its handle, a reconnect is a remove & an add
+    REGISTRY_ADDED = 1,
+    REGISTRY_REMOVED,
+};
 
-void linkedList_add(Node* array, Node* node);
+typedef struct registryEvent {
+    uint64_t version; // Registry version this event produced
+    enum REGISTRY_EVENT_TYPE type;
+    clientHandle handle;
+    char ip[INET_ADDRSTRLEN]; // Empty for REGISTRY_REMOVED
+} registryEvent;
 
-int hash_put(hashMap* hash, client* client);
+typedef struct slotTable {
+    _Atomic(clientSlot*) chunks[SLOT_MAX_CHUNKS];
+    atomic_uint used; // Slots handed out at least once, bounds slot_forEach
+    uint32_t free_head; // FIFO, so a freed slot (& its generation) is reused as late as possible
+    uint32_t free_tail;
+    atomic_int count;
+    pthread_mutex_t mutex; // Writers & change log readers, slot readers never lock
+    uint64_t version; // Bumped by every slot_put()/slot_remove(), 0 = empty registry
+    registryEvent log[REGISTRY_LOG_SIZE]; // Ring, the event of version v is log[v % REGISTRY_LOG_SIZE]
+} slotTable;
 
-int hash_remove(hashMap* hash, char* id);
+extern slotTable* clientSlots;
 
-client* hash_grab(hashMap* hash, char* id);
+slotTable* slot_init();
 
-void hash_destroy(hashMap* hash);
+clientHandle slot_put(slotTable* table, client* cli); // Assigns cli->handle & takes its own reference, 0 if full
+
+int slot_remove(slotTable* table, clientHandle handle); // Drops clientSlots' reference, bumps the slot generation
+
+client* slot_grab(slotTable* table, clientHandle handle); // Lock-free, returns a referenced client: client_release() it when done
+
+void slot_forEach(slotTable* table, void (*fn)(client* cli, void* arg), void* arg); // Lock-free, fn must not block or keep cli
+
+uint64_t slot_version(slotTable* table); // Read before a slot_forEach() snapshot, deltas after it are idempotent on top of it
+
+int slot_logRead(slotTable* table, uint64_t after, registryEvent* out, int max); // Events newer than after, oldest first, -1 if already overwritten
+
+void slot_destroy(slotTable* table);
 
 
 /* * * * * * * * * * * * * * * * * */
@@ -83,13 +134,17 @@ void hash_destroy(hashMap* hash);
 
 void queue_init(Queue* q);
 
-queueNode* queue_createNode(char* buffer);
+queueNode* queue_createNode(char* buffer, size_t len); // Takes ownership of buffer (pool_bufAlloc'd), no copy
+
+void queue_deleteNode(queueNode* node); // For nodes that never made it into a queue
 
 int queue_isEmpty(Queue* q);
 
 int queue_push(Queue* q, queueNode* qN);
 
-char* queue_pop(Queue* q);
+char* queue_pop(Queue* q, size_t* len); // Non-blocking, NULL when empty. Caller owns the returned buffer (pool_bufFree)
+
+void queue_ackEvent(Queue* q); // Consumer side: reset event_fd before draining the queue
 
 void queue_destroy(Queue* q);
 
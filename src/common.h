@@ -21,7 +21,7 @@
 #include "cJSON.h"
 #include "cJSON_Utils.h"
 
-#define MAX_QUEUE 5
+#define MAX_QUEUE SOMAXCONN // listen() backlog, agents reconnect in bursts
 #define BUFFER_SIZE 2048
 #define SERVER_PORT 3333
 #define SERVER_IP "127.0.0.1"
@@ -0,0 +1,93 @@
+#include "ebr.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct ebrRecord {
+    atomic_int active; // Inside a critical section
+    atomic_uint_fast64_t epoch; // Global epoch observed by ebr_enter()
+    struct ebrRecord* next;
+} ebrRecord;
+
+typedef struct ebrRetired {
+    void* obj;
+    ebr_free_fn free_fn;
+    uint64_t epoch; // Global epoch when retired
+    struct ebrRetired* next;
+} ebrRetired;
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(ebrRecord*) records = NULL; // One per thread that ever entered, never unlinked
+
+static __thread ebrRecord* thread_record = NULL;
+static __thread ebrRetired* limbo = NULL; // This thread's retired objects, newest first
+static __thread int limbo_count = 0;
+
+static pool retired_pool = POOL_INITIALIZER("ebrRetired", sizeof(ebrRetired));
+
+static ebrRecord* ebr_record() {
+    if (thread_record) return thread_record;
+
+    ebrRecord* rec = malloc(sizeof(ebrRecord));
+    if (!rec) {
+        fprintf(stderr, "[ERROR] [ebr/ebr_record] Failed to allocate thread record\n");
+        exit(1);
+    }
+    atomic_init(&rec->active, 0);
+    atomic_init(&rec->epoch, 0);
+    rec->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &rec->next, rec));
+    thread_record = rec;
+    return rec;
+}
+
+void ebr_enter() {
+    ebrRecord* rec = ebr_record();
+    atomic_store(&rec->active, 1);
+    atomic_store(&rec->epoch, atomic_load(&global_epoch));
+    atomic_thread_fence(memory_order_seq_cst); // Announce before touching any shared pointer
+}
+
+void ebr_exit() {
+    atomic_store_explicit(&thread_record->active, 0, memory_order_release);
+}
+
+static uint64_t ebr_tryAdvance() {
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (ebrRecord* rec = atomic_load(&records); rec != NULL; rec = rec->next) {
+        if (atomic_load(&rec->active) && atomic_load(&rec->epoch) != epoch)
+            return epoch; // Someone is still reading in an older epoch
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+    return atomic_load(&global_epoch);
+}
+
+void ebr_collect() {
+    uint64_t epoch = ebr_tryAdvance();
+    ebrRetired** pp = &limbo;
+    while (*pp != NULL) {
+        ebrRetired* r = *pp;
+        if (r->epoch + 2 <= epoch) {
+            *pp = r->next;
+            r->free_fn(r->obj);
+            pool_free(&retired_pool, r);
+            limbo_count--;
+        } else {
+            pp = &r->next;
+        }
+    }
+}
+
+void ebr_retire(void* obj, ebr_free_fn free_fn) {
+    ebrRetired* r = pool_alloc(&retired_pool);
+    if (!r) {
+        fprintf(stderr, "[ERROR] [ebr/ebr_retire] Failed to allocate retire entry, leaking object\n");
+        return;
+    }
+    r->obj = obj;
+    r->free_fn = free_fn;
+    r->epoch = atomic_load(&global_epoch);
+    r->next = limbo;
+    limbo = r;
+    if (++limbo_count >= EBR_COLLECT_THRESHOLD) ebr_collect();
+}
@@ -0,0 +1,39 @@
+#ifndef EBR_H_INCLUDED
+#define EBR_H_INCLUDED
+
+
+#ifndef EBR // Include guard
+#define EBR
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define EBR_COLLECT_THRESHOLD 64 // Retired objects per thread before trying to reclaim
+
+/*
+ *
+ * EPOCH BASED RECLAMATION:
+ * LOCK-FREE READERS (slot_grab, slot_forEach) WRAP THEIR TRAVERSAL IN ebr_enter()/ebr_exit()
+ * WRITERS UNLINK AN OBJECT & ebr_retire() IT INSTEAD OF FREEING IT
+ *
+ *      A RETIRED OBJECT IS FREED ONCE THE GLOBAL EPOCH MOVED TWICE PAST ITS RETIREMENT
+ *      THE EPOCH ONLY MOVES WHEN EVERY THREAD INSIDE A CRITICAL SECTION HAS SEEN THE CURRENT ONE
+ *      SO NO READER CAN STILL HOLD A POINTER TO IT
+ *
+ * CRITICAL SECTIONS MUST BE SHORT & MUST NOT NEST
+ *
+ */
+
+typedef void (*ebr_free_fn)(void* obj);
+
+void ebr_enter();
+
+void ebr_exit();
+
+void ebr_retire(void* obj, ebr_free_fn free_fn);
+
+void ebr_collect();
+
+#endif
+
+#endif // EBR_H_INCLUDED
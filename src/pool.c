@@ -0,0 +1,177 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct poolCache {
+    void* head; // Singly linked through the first word of each free object
+    int count;
+} poolCache;
+
+typedef struct bufHeader {
+    size_t size_class; // Index in buf_pools, POOL_BUF_CLASSES for malloc'd buffers
+    size_t pad; // Keeps the returned buffer 16-byte aligned
+} bufHeader;
+
+static __thread poolCache thread_caches[POOL_MAX + 1]; // Thread caches are never flushed, worker threads live as long as the server
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pool* registry[POOL_MAX + 1];
+static int registry_count = 0;
+
+#define BUF_POOL(bytes) POOL_INITIALIZER("buffer_" #bytes, sizeof(bufHeader) + (bytes))
+static pool buf_pools[POOL_BUF_CLASSES] = {
+    BUF_POOL(32), BUF_POOL(64), BUF_POOL(128), BUF_POOL(256), BUF_POOL(512),
+    BUF_POOL(1024), BUF_POOL(2048), BUF_POOL(4096), BUF_POOL(8192),
+};
+
+static int pool_register(pool* p) {
+    pthread_mutex_lock(&registry_mutex);
+    int id = atomic_load(&p->id);
+    if (id == 0) {
+        if (registry_count == POOL_MAX) {
+            pthread_mutex_unlock(&registry_mutex);
+            fprintf(stderr, "[ERROR] [pool/pool_register] Too many pools, raise POOL_MAX (%s)\n", p->name);
+            return 0;
+        }
+        if (p->obj_size < sizeof(void*)) p->obj_size = sizeof(void*);
+        p->obj_size = (p->obj_size + 15) & ~(size_t)15; // Every slab object stays 16-byte aligned
+        id = ++registry_count;
+        registry[id] = p;
+        atomic_store(&p->id, id);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return id;
+}
+
+static void pool_refill(pool* p, poolCache* cache) {
+    pthread_mutex_lock(&p->depot_mutex);
+    if (p->depot_count == 0) {
+        char* slab = malloc(p->obj_size * POOL_SLAB_OBJS);
+        if (!slab) {
+            pthread_mutex_unlock(&p->depot_mutex);
+            fprintf(stderr, "[ERROR] [pool/pool_refill] Failed to allocate slab for %s\n", p->name);
+            return;
+        }
+        for (int i = 0; i < POOL_SLAB_OBJS; i++) {
+            void* obj = slab + i * p->obj_size;
+            *(void**)obj = p->depot;
+            p->depot = obj;
+        }
+        p->depot_count += POOL_SLAB_OBJS;
+        atomic_fetch_add(&p->slabs, 1);
+    }
+    for (int i = 0; i < POOL_BATCH && p->depot; i++) {
+        void* obj = p->depot;
+        p->depot = *(void**)obj;
+        p->depot_count--;
+        *(void**)obj = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&p->depot_mutex);
+    atomic_fetch_add(&p->refills, 1);
+}
+
+static void pool_spill(pool* p, poolCache* cache) {
+    pthread_mutex_lock(&p->depot_mutex);
+    for (int i = 0; i < POOL_BATCH && cache->head; i++) {
+        void* obj = cache->head;
+        cache->head = *(void**)obj;
+        cache->count--;
+        *(void**)obj = p->depot;
+        p->depot = obj;
+        p->depot_count++;
+    }
+    pthread_mutex_unlock(&p->depot_mutex);
+}
+
+void* pool_alloc(pool* p) {
+    int id = atomic_load_explicit(&p->id, memory_order_acquire);
+    if (id == 0 && (id = pool_register(p)) == 0) return NULL;
+
+    void* obj;
+    if (POOL_PASSTHROUGH) {
+        obj = malloc(p->obj_size);
+        if (!obj) return NULL;
+    } else {
+        poolCache* cache = &thread_caches[id];
+        if (!cache->head) pool_refill(p, cache);
+        if (!cache->head) return NULL;
+
+        obj = cache->head;
+        cache->head = *(void**)obj;
+        cache->count--;
+    }
+
+    size_t in_use = atomic_fetch_add_explicit(&p->in_use, 1, memory_order_relaxed) + 1;
+    size_t high = atomic_load_explicit(&p->high_water, memory_order_relaxed);
+    while (in_use > high && !atomic_compare_exchange_weak(&p->high_water, &high, in_use));
+    return obj;
+}
+
+void pool_free(pool* p, void* obj) {
+    if (!obj) return;
+    if (POOL_PASSTHROUGH) {
+        free(obj);
+        atomic_fetch_sub_explicit(&p->in_use, 1, memory_order_relaxed);
+        return;
+    }
+    poolCache* cache = &thread_caches[atomic_load_explicit(&p->id, memory_order_acquire)];
+    *(void**)obj = cache->head;
+    cache->head = obj;
+    cache->count++;
+    atomic_fetch_sub_explicit(&p->in_use, 1, memory_order_relaxed);
+    if (cache->count > 2 * POOL_BATCH) pool_spill(p, cache);
+}
+
+void pool_getStats(pool* p, poolStats* stats) {
+    stats->in_use = atomic_load(&p->in_use);
+    stats->high_water = atomic_load(&p->high_water);
+    stats->refills = atomic_load(&p->refills);
+    stats->slabs = atomic_load(&p->slabs);
+}
+
+void pool_printStats(FILE* out) {
+    pthread_mutex_lock(&registry_mutex);
+    for (int i = 1; i <= registry_count; i++) {
+        poolStats st;
+        pool_getStats(registry[i], &st);
+        fprintf(out, "[POOL] %-18s obj=%-6zu in_use=%-8zu high_water=%-8zu refills=%-8zu slabs=%zu\n",
+                registry[i]->name, registry[i]->obj_size, st.in_use, st.high_water, st.refills, st.slabs);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+
+void* pool_bufAlloc(size_t size) {
+    size_t size_class = 0;
+    while (size_class < POOL_BUF_CLASSES && ((size_t)1 << (size_class + POOL_BUF_MIN_SHIFT)) < size)
+        size_class++;
+
+    bufHeader* hdr;
+    if (size_class == POOL_BUF_CLASSES)
+        hdr = malloc(sizeof(bufHeader) + size); // Too big for a size class
+    else
+        hdr = pool_alloc(&buf_pools[size_class]);
+    if (!hdr) return NULL;
+    hdr->size_class = size_class;
+    return hdr + 1;
+}
+
+void pool_bufFree(void* buf) {
+    if (!buf) return;
+    bufHeader* hdr = (bufHeader*)buf - 1;
+    if (hdr->size_class == POOL_BUF_CLASSES)
+        free(hdr);
+    else
+        pool_free(&buf_pools[hdr->size_class], hdr);
+}
+
+char* pool_strndup(const char* str, size_t len) {
+    char* copy = pool_bufAlloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
@@ -0,0 +1,86 @@
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+
+#ifndef POOL // Include guard
+#define POOL
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define POOL_MAX 32 // Max number of registered pools (fixed structs + buffer size classes)
+#define POOL_BATCH 32 // Objects moved between a thread cache and the shared depot at once
+#define POOL_SLAB_OBJS 256 // Objects carved out of one slab when the depot runs dry
+
+#define POOL_BUF_MIN_SHIFT 5 // Smallest buffer size class: 32 bytes
+#define POOL_BUF_CLASSES 9 // 32, 64, ... 8192 bytes, bigger buffers go straight to malloc
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define POOL_PASSTHROUGH 1
+#endif
+#endif
+#if !defined(POOL_PASSTHROUGH) && (defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__))
+#define POOL_PASSTHROUGH 1
+#endif
+#ifndef POOL_PASSTHROUGH
+#define POOL_PASSTHROUGH 0 // 1 under ASan/TSan: every object is malloc'd & freed, a recycled slab would hide a use-after-free
+#endif
+
+/*
+ *
+ * SLAB POOLS:
+ * FIXED SIZE OBJECTS (queueNode, client, PROTOCOL_MESSAGE, pendingCommand, connEntry) & SIZE-CLASS BUFFERS
+ *
+ *      pool_alloc/pool_free HIT A PER-THREAD FREE LIST FIRST, NO LOCK
+ *      EMPTY/FULL THREAD CACHES EXCHANGE POOL_BATCH OBJECTS WITH THE POOL'S SHARED DEPOT (LOCKED)
+ *      THE DEPOT GROWS BY WHOLE SLABS & NEVER GIVES MEMORY BACK, SO STEADY STATE DOES NO malloc
+ *
+ * OBJECTS MAY BE FREED BY ANOTHER THREAD THAN THE ONE THAT ALLOCATED THEM
+ *
+ */
+
+typedef struct poolStats {
+    size_t in_use; // Objects currently handed out
+    size_t high_water; // Max in_use seen
+    size_t refills; // Thread cache refills from the depot
+    size_t slabs; // Slabs malloc'd
+} poolStats;
+
+typedef struct pool {
+    const char* name;
+    size_t obj_size;
+    atomic_int id; // Index in the thread caches, 0 until first use
+
+    pthread_mutex_t depot_mutex;
+    void* depot; // Free objects handed back by thread caches
+    size_t depot_count;
+
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+    atomic_size_t refills;
+    atomic_size_t slabs;
+} pool;
+
+#define POOL_INITIALIZER(poolName, size) { .name = (poolName), .obj_size = (size), .depot_mutex = PTHREAD_MUTEX_INITIALIZER }
+
+void* pool_alloc(pool* p);
+
+void pool_free(pool* p, void* obj);
+
+void pool_getStats(pool* p, poolStats* stats);
+
+void pool_printStats(FILE* out);
+
+
+void* pool_bufAlloc(size_t size);
+
+void pool_bufFree(void* buf);
+
+char* pool_strndup(const char* str, size_t len);
+
+#endif
+
+#endif // POOL_H_INCLUDED
@@ -1,224 +1,560 @@
-#include "cJSON.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "client_mgmt.h"
 #include "websocket.h"
 #include "common.h"
+#include "protocolhandler.h"
+#include "pool.h"
 
-#define CSERVER "MAIN"
-#define WEBSERVER "WEBSOCK"
-#define REACTFRONT "FRONTEND"
 
+static pool protocolMsg_pool = POOL_INITIALIZER("PROTOCOL_MESSAGE", sizeof(PROTOCOL_MESSAGE));
+static pool pendingCmd_pool = POOL_INITIALIZER("pendingCommand", sizeof(pendingCommand));
 
-enum PROTOCOL_MESSAGE_TYPES {
-    CONNECT = 1, // Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE
-    BEACON, // Sent by CLIENT
-    DISCONNECT, // Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE
+static atomic_uint next_request_id = 1;
 
-    REQUEST,
-    RESPONSE,
+#define PROTOCOL_NAME(name) [name] = { #name, sizeof(#name) - 1 },
 
-    SELECT_CLIENT, // Sent by REACT FRONTEND to C SERVER
-    COMMAND, // Sent by REACT FRONTEND to C SERVER
-    LIST_UPDATE, // Sent by C SERVER to REACT FRONTEND
+static const protocolName msgTypeNames[MSG_TYPE_COUNT] = {
+    [MSG_TYPE_NONE] = { "", 0 },
+    PROTOCOL_MESSAGE_TYPES_LIST(PROTOCOL_NAME)
 };
 
-enum PROTOCOl_CONTENT_TYPE {
-    CMD_OUTPUT = 1,
-    CONNECTION_LIST,
+static const protocolName contentTypeNames[CONTENT_TYPE_COUNT] = {
+    [CONTENT_TYPE_NONE] = { "", 0 },
+    PROTOCOL_CONTENT_TYPES_LIST(PROTOCOL_NAME)
 };
 
-typedef struct PROTOCOL_MESSAGE {
-    enum PROTOCOL_MESSAGE_TYPES msg_type;
-    enum PROTOCOl_CONTENT_TYPE content_type;
+/*
+ *
+ * TYPE LOOKUP:
+ * NAME -> ENUM IS ONE FNV-1a HASH OF THE NAME & ONE OR TWO PROBES INTO AN OPEN-ADDRESSING TABLE, NOT A strcmp() PER TYPE
+ *
+ *      THE TABLES HOLD ENUM VALUES (0 = EMPTY SLOT), FILLED ONCE FROM THE NAME TABLES ABOVE ON THE FIRST LOOKUP
+ *      A PROBE ENDS ON AN EMPTY SLOT, AN UNKNOWN NAME CAN NOT RUN OFF THE TABLE (THE OLD "NULL" SENTINEL NEVER ENDED THE LOOP)
+ *
+ */
+#define TYPE_TABLE_SIZE 64 // Power of two, kept over 4x the types of either kind so probes stay short
 
-    char* destination;
-    char* source;
+_Static_assert(MSG_TYPE_COUNT * 4 <= TYPE_TABLE_SIZE && CONTENT_TYPE_COUNT * 4 <= TYPE_TABLE_SIZE, "Grow TYPE_TABLE_SIZE");
 
-    char* payload;
-    int payload_size;
+static uint8_t msgTypeTable[TYPE_TABLE_SIZE];
+static uint8_t contentTypeTable[TYPE_TABLE_SIZE];
+static pthread_once_t typeTables_once = PTHREAD_ONCE_INIT;
 
-    char* specifiedClient_id;
-    int clientID_size;
-} PROTOCOL_MESSAGE;
+static uint32_t type_hash(const char* str, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    return h;
+}
 
+static void type_tableFill(uint8_t* table, const protocolName* names, int count) {
+    for (int enu = 1; enu < count; enu++) {
+        uint32_t i = type_hash(names[enu].str, names[enu].len) & (TYPE_TABLE_SIZE - 1);
+        while (table[i]) i = (i + 1) & (TYPE_TABLE_SIZE - 1);
+        table[i] = (uint8_t)enu;
+    }
+}
 
-typedef struct contentMap {
-    char* str;
-    enum PROTOCOl_CONTENT_TYPE enu;
-} contentMap;
+static void type_tablesInit() {
+    type_tableFill(msgTypeTable, msgTypeNames, MSG_TYPE_COUNT);
+    type_tableFill(contentTypeTable, contentTypeNames, CONTENT_TYPE_COUNT);
+}
 
-typedef struct messageTypeMap {
-    char* str;
-    enum PROTOCOL_MESSAGE_TYPES enu;
-} messageTypeMap;
+// Enum value of str, 0 if it names no type
+static int type_lookup(const uint8_t* table, const protocolName* names, const char* str, size_t len) {
+    pthread_once(&typeTables_once, type_tablesInit);
+    for (uint32_t i = type_hash(str, len) & (TYPE_TABLE_SIZE - 1); table[i]; i = (i + 1) & (TYPE_TABLE_SIZE - 1)) {
+        const protocolName* name = &names[table[i]];
+        if (name->len == len && memcmp(name->str, str, len) == 0) return table[i];
+    }
+    return 0;
+}
 
-contentMap contentTypes[] = {
-    {"CMD_OUTPUT", CMD_OUTPUT},
-    {"CONNECTION_LIST", CONNECTION_LIST},
-    {"NULL", 0},
-};
+const protocolName* protocol_msgTypeName(enum PROTOCOL_MESSAGE_TYPES type) {
+    return type > MSG_TYPE_NONE && type < MSG_TYPE_COUNT ? &msgTypeNames[type] : NULL;
+}
 
-messageTypeMap msgTypes[] = {
-    {"CONNECT", CONNECT},
-    {"BEACON", BEACON},
-    {"DISCONNECT", DISCONNECT},
-    {"REQUEST", REQUEST},
-    {"RESPONSE", RESPONSE},
-    {"SELECT_CLIENT", SELECT_CLIENT},
-    {"COMMAND", COMMAND},
-    {"LIST_UPDATE", LIST_UPDATE},
-    {"NULL", 0},
-};
+const protocolName* protocol_contentTypeName(enum PROTOCOl_CONTENT_TYPE type) {
+    return type > CONTENT_TYPE_NONE && type < CONTENT_TYPE_COUNT ? &contentTypeNames[type] : NULL;
+}
 
 void delete_protocol_msg(PROTOCOL_MESSAGE* msg) {
     if (msg) {
-        free(msg->destination);
+        if (!msg->borrowed) { // Parsed messages point into the receive buffer
+            pool_bufFree(msg->destination);
+            pool_bufFree(msg->source);
+            pool_bufFree(msg->payload);
+        }
         msg->destination = NULL; // prevent use-after-free
-        free(msg->source);
         msg->source = NULL;
-        free(msg->specifiedClient_id);
-        msg->specifiedClient_id = NULL;
-        free(msg->payload);
         msg->payload = NULL;
-        free(msg);
+        pool_bufFree(msg->query);
+        msg->query = NULL;
+        pool_free(&protocolMsg_pool, msg);
     }
 }
 
-PROTOCOL_MESSAGE* parse_message(char* jsonString) {
-    PROTOCOL_MESSAGE* msgStruct = malloc(sizeof(PROTOCOL_MESSAGE));
-    if (!msgStruct) {
-        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct\n");
-        return NULL;
+/*
+ *
+ * MESSAGE DECODER:
+ * ONE PASS OVER THE RECEIVED JSON, NO DOM: THE PROTOCOL'S KEYS ARE DECODED AS THEY COME, ANY OTHER VALUE IS SKIPPED
+ *
+ *      STRINGS ARE UNESCAPED IN PLACE (NEVER LONGER THAN THEIR ESCAPED FORM) & NUL-TERMINATED OVER THEIR CLOSING QUOTE
+ *      SHORT STRINGS ARE SCANNED 8 BYTES AT A TIME, LONGER PLAIN RUNS WITH memchr(), RAW CONTROL CHARACTERS ARE LET THROUGH
+ *      destination / source / payload POINT INTO THE RECEIVE BUFFER (msg->borrowed), VALID UNTIL THE CALLBACK RETURNS
+ *      KEYS MATCH EXACTLY (cJSON_GetObjectItem() IGNORED CASE), NUMBERS MUST BE INTEGERS, A FRACTION IS TRUNCATED
+ *      A NUMBER WITH AN EXPONENT OR OUT OF RANGE LEAVES ITS FIELD UNSET, LIKE A VALUE OF THE WRONG TYPE
+ *
+ * ONLY THE PROTOCOL_MESSAGE (& A query) COME FROM THE POOLS, NOTHING ELSE IS ALLOCATED
+ *
+ */
+
+#define JSON_MAX_DEPTH 32 // Nesting of skipped values
+#define JSON_SHORT_STRING 24 // Strings closed within this many bytes skip memchr()
+#define JSON_ONES 0x0101010101010101ULL
+#define JSON_HIGHS 0x8080808080808080ULL
+
+typedef struct jsonReader {
+    char* p;
+    char* end;
+} jsonReader;
+
+static void json_skipWs(jsonReader* r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) r->p++;
+}
+
+static int json_accept(jsonReader* r, char c) {
+    json_skipWs(r);
+    if (r->p < r->end && *r->p == c) {
+        r->p++;
+        return 1;
     }
-    msgStruct->destination = NULL;
-    msgStruct->source = NULL;
-    msgStruct->specifiedClient_id = NULL;
-    msgStruct->payload = NULL;
+    return 0;
+}
 
-    cJSON* jsonStruct = cJSON_Parse(jsonString);
-    if (!jsonStruct) {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr) printf("JSON Parse Error: %s\n", error_ptr);
-        delete_protocol_msg(msgStruct);
-        return NULL;
+static int json_hex4(const char* p, uint32_t* out) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
     }
+    *out = v;
+    return 0;
+}
 
-    cJSON* type = cJSON_GetObjectItem(jsonStruct, "type");
-    if (cJSON_IsString(type)) {
-        int found = 0;
-        for (int i = 0; msgTypes[i].str != NULL; i++) {
-            if (strcmp(msgTypes[i].str, type->valuestring) == 0) {
-                msgStruct->msg_type = msgTypes[i].enu;
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Invalid message type: %s\n", type->valuestring);
-            delete_protocol_msg(msgStruct);
-            cJSON_Delete(jsonStruct);
-            return NULL;
-        }
+static char* json_putUtf8(char* w, uint32_t cp) {
+    if (cp < 0x80) {
+        *w++ = (char)cp;
+    } else if (cp < 0x800) {
+        *w++ = (char)(0xC0 | (cp >> 6));
+        *w++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *w++ = (char)(0xE0 | (cp >> 12));
+        *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *w++ = (char)(0x80 | (cp & 0x3F));
     } else {
-        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Missing or invalid 'type'\n");
-        delete_protocol_msg(msgStruct);
-        cJSON_Delete(jsonStruct);
-        return NULL;
+        *w++ = (char)(0xF0 | (cp >> 18));
+        *w++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *w++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return w;
+}
+
+// First '"' or '\\' in [p, stop), 8 bytes per step, stop if none
+static char* json_scanSpecial(char* p, char* stop) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (stop - p >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        uint64_t quote = x ^ (JSON_ONES * '"');
+        uint64_t slash = x ^ (JSON_ONES * '\\');
+        uint64_t hit = (((quote - JSON_ONES) & ~quote) | ((slash - JSON_ONES) & ~slash)) & JSON_HIGHS; // Lowest set bit is exact
+        if (hit) return p + (__builtin_ctzll(hit) >> 3);
+        p += 8;
+    }
+#endif
+    while (p < stop && *p != '"' && *p != '\\') p++;
+    return p;
+}
+
+// json_scanSpecial() that also moves [p, stop) down to *w (*w < p), *w is advanced past the moved bytes
+static char* json_moveSpecial(char** w, char* p, char* end) {
+    char* d = *w;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - p >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        uint64_t quote = x ^ (JSON_ONES * '"');
+        uint64_t slash = x ^ (JSON_ONES * '\\');
+        uint64_t hit = (((quote - JSON_ONES) & ~quote) | ((slash - JSON_ONES) & ~slash)) & JSON_HIGHS;
+        if (hit) break;
+        memcpy(d, &x, 8); // Only overwrites bytes below p + 8, all read into x already
+        d += 8;
+        p += 8;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') *d++ = *p++;
+    *w = d;
+    return p;
+}
+
+// Within JSON_SHORT_STRING bytes of p, anything else past the window means "not found"
+static char* json_scanShort(char* p, char* end) {
+    return json_scanSpecial(p, end - p > JSON_SHORT_STRING ? p + JSON_SHORT_STRING : end);
+}
+
+// r->p on the opening quote. Unescapes in place, *out is NUL-terminated, -1 if malformed
+static int json_string(jsonReader* r, char** out, size_t* len) {
+    json_skipWs(r);
+    if (r->p >= r->end || *r->p != '"') return -1;
+    char* start = ++r->p;
+
+    char* p = json_scanShort(start, r->end); // Keys & most values are short & plain, memchr() calls cost more than they save on them
+    if (p < r->end && *p == '"') {
+        *p = '\0';
+        *out = start;
+        *len = p - start;
+        r->p = p + 1;
+        return 0;
     }
 
+    char* quote = memchr(r->p, '"', r->end - r->p); // Closing quote unless an escape turns out to own it
+    if (!quote) return -1;
+    char* escape = memchr(r->p, '\\', quote - r->p);
+    if (!escape) { // Long & plain, memchr() all the way
+        *quote = '\0';
+        *out = start;
+        *len = quote - start;
+        r->p = quote + 1;
+        return 0;
+    }
 
-    cJSON* content = cJSON_GetObjectItem(jsonStruct, "content");
-    if (cJSON_IsString(content)) {
-        int found = 0;
-        for (int i = 0; contentTypes[i].str != NULL; i++) {
-            if (strcmp(contentTypes[i].str, content->valuestring) == 0) {
-                msgStruct->content_type = contentTypes[i].enu;
-                found = 1;
+    char* w = escape; // Trails r->p once an escape was shrunk, plain runs between escapes are moved down as they are scanned
+    r->p = escape;
+    for (;;) {
+        char* stop = json_moveSpecial(&w, r->p, r->end);
+        if (stop >= r->end) return -1;
+        r->p = stop + 1;
+        if (*stop == '"') {
+            *w = '\0';
+            *out = start;
+            *len = w - start;
+            return 0;
+        }
+
+        if (r->p >= r->end) return -1;
+        switch (*r->p++) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '/': *w++ = '/'; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                uint32_t cp, low;
+                if (r->end - r->p < 4 || json_hex4(r->p, &cp) != 0) return -1;
+                r->p += 4;
+                if (cp >= 0xDC00 && cp <= 0xDFFF) return -1; // Lone low surrogate
+                if (cp >= 0xD800 && cp <= 0xDBFF) { // High surrogate, its low half must follow
+                    if (r->end - r->p < 6 || r->p[0] != '\\' || r->p[1] != 'u' || json_hex4(r->p + 2, &low) != 0 ||
+                        low < 0xDC00 || low > 0xDFFF)
+                        return -1;
+                    r->p += 6;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                w = json_putUtf8(w, cp);
                 break;
             }
-        }
-        if (!found) {
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Invalid content type: %s\n", content->valuestring);
-            delete_protocol_msg(msgStruct);
-            cJSON_Delete(jsonStruct);
-            return NULL;
+            default:
+                return -1;
         }
     }
+}
 
-    cJSON* destination = cJSON_GetObjectItem(jsonStruct, "destination");
-    if (cJSON_IsString(destination)) {
-        msgStruct->destination = malloc(strlen(destination->valuestring) + 1);
-        if (!msgStruct->destination){
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct->destination\n");
-            delete_protocol_msg(msgStruct);
-            return NULL;
-        }
-        snprintf(msgStruct->destination, strlen(destination->valuestring) + 1, "%s", destination->valuestring);
+// 1 with *out set, 0 if the number is valid JSON but not an integer that fits, -1 if malformed
+static int json_integer(jsonReader* r, int64_t* out) {
+    json_skipWs(r);
+    int negative = r->p < r->end && *r->p == '-';
+    if (negative) r->p++;
+    if (r->p >= r->end || *r->p < '0' || *r->p > '9') return -1;
+    uint64_t v = 0;
+    int fits = 1;
+    while (r->p < r->end && *r->p >= '0' && *r->p <= '9') {
+        if (v > (INT64_MAX - 9) / 10) fits = 0;
+        else v = v * 10 + (*r->p - '0');
+        r->p++;
+    }
+    if (r->p < r->end && *r->p == '.') { // Truncated, like the (uint32_t) casts of valuedouble were
+        r->p++;
+        if (r->p >= r->end || *r->p < '0' || *r->p > '9') return -1;
+        while (r->p < r->end && *r->p >= '0' && *r->p <= '9') r->p++;
+    }
+    if (r->p < r->end && (*r->p == 'e' || *r->p == 'E')) {
+        r->p++;
+        if (r->p < r->end && (*r->p == '+' || *r->p == '-')) r->p++;
+        if (r->p >= r->end || *r->p < '0' || *r->p > '9') return -1;
+        while (r->p < r->end && *r->p >= '0' && *r->p <= '9') r->p++;
+        fits = 0;
     }
+    *out = negative ? -(int64_t)v : (int64_t)v;
+    return fits;
+}
 
-    cJSON* source = cJSON_GetObjectItem(jsonStruct, "source");
-    if (cJSON_IsString(source)) {
-        msgStruct->source = malloc(strlen(source->valuestring) + 1);
-        if (!msgStruct->source){
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct->source\n");
-            delete_protocol_msg(msgStruct);
-            return NULL;
-        }
+static int json_literal(jsonReader* r, const char* word) {
+    size_t len = strlen(word);
+    if ((size_t)(r->end - r->p) < len || memcmp(r->p, word, len) != 0) return -1;
+    r->p += len;
+    return 0;
+}
 
-        snprintf(msgStruct->source, strlen(source->valuestring) + 1, "%s", source->valuestring);
+static int json_skipValue(jsonReader* r) {
+    char* str;
+    size_t len;
+    int64_t num;
+    json_skipWs(r);
+    if (r->p >= r->end) return -1;
+    switch (*r->p) {
+        case '"': return json_string(r, &str, &len);
+        case 't': return json_literal(r, "true");
+        case 'f': return json_literal(r, "false");
+        case 'n': return json_literal(r, "null");
+        case '{':
+        case '[':
+            break;
+        default:
+            return json_integer(r, &num) < 0 ? -1 : 0;
     }
 
-    cJSON* selectedClient = cJSON_GetObjectItem(jsonStruct, "selectedClient");
-    if (cJSON_IsString(selectedClient)) {
-        msgStruct->specifiedClient_id = malloc(strlen(selectedClient->valuestring) + 1);
-        if (!msgStruct->specifiedClient_id){
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct->specifiedClient_id\n");
-            delete_protocol_msg(msgStruct);
-            return NULL;
+    int depth = 0; // Containers are only checked for balance, their members are never used
+    do {
+        if (r->p >= r->end) return -1;
+        char c = *r->p;
+        if (c == '"') {
+            if (json_string(r, &str, &len) != 0) return -1;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            if (++depth > JSON_MAX_DEPTH) return -1;
+        } else if (c == '}' || c == ']') {
+            depth--;
         }
+        r->p++;
+    } while (depth > 0);
+    return 0;
+}
+
+// Numeric field: -1 if malformed, 0 if of another type / not an integer (skipped), 1 with *out set
+static int json_intField(jsonReader* r, int64_t* out) {
+    json_skipWs(r);
+    if (r->p < r->end && (*r->p == '-' || (*r->p >= '0' && *r->p <= '9')))
+        return json_integer(r, out);
+    return json_skipValue(r) == 0 ? 0 : -1;
+}
+
+// String field: -1 if malformed, 0 if of another type (skipped), 1 with *out set
+static int json_strField(jsonReader* r, char** out, size_t* len) {
+    json_skipWs(r);
+    if (r->p < r->end && *r->p == '"')
+        return json_string(r, out, len) == 0 ? 1 : -1;
+    return json_skipValue(r) == 0 ? 0 : -1;
+}
+
+// Calls field() for every member of the object at r->p, field() consumes the value
+static int json_object(jsonReader* r, int (*field)(jsonReader* r, const char* key, void* ctx), void* ctx) {
+    if (!json_accept(r, '{')) return -1;
+    if (json_accept(r, '}')) return 0;
+    do {
+        char* key;
+        size_t len;
+        if (json_string(r, &key, &len) != 0 || !json_accept(r, ':')) return -1;
+        if (field(r, key, ctx) != 0) return -1;
+    } while (json_accept(r, ','));
+    return json_accept(r, '}') ? 0 : -1;
+}
 
-        snprintf(msgStruct->specifiedClient_id, strlen(selectedClient->valuestring) + 1, "%s", selectedClient->valuestring);
+static int decode_queryString(jsonReader* r, const char* key, char* out, size_t size) {
+    char* str;
+    size_t len;
+    int got = json_strField(r, &str, &len);
+    if (got <= 0) return got;
+    if (len >= size) { // Truncated, it would match entries the real value does not
+        fprintf(stderr, "[ERROR] [protocolhandler/decode_queryString] Query field '%s' too long: %s\n", key, str);
+        return -1;
     }
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)str[i] < 0x20 || (unsigned char)str[i] > 0x7E) { // Index keys are printable ASCII, index_prefixEnd() relies on it
+            fprintf(stderr, "[ERROR] [protocolhandler/decode_queryString] Query field '%s' has a byte outside printable ASCII (0x%02x)\n", key, (unsigned char)str[i]);
+            return -1;
+        }
+    }
+    memcpy(out, str, len + 1);
+    return 0;
+}
 
-    cJSON* payload_size = cJSON_GetObjectItem(jsonStruct, "payload_size");
-    if (cJSON_IsNumber(payload_size)) {
-        msgStruct->payload_size = payload_size->valueint;
+static int decode_queryField(jsonReader* r, const char* key, void* ctx) {
+    connectionQuery* query = ctx;
+    int64_t v;
+    if (strcmp(key, "offset") == 0) {
+        int got = json_intField(r, &v);
+        if (got == 1 && v >= 0 && v <= UINT32_MAX) query->offset = (uint32_t)v;
+        return got < 0 ? -1 : 0;
+    }
+    if (strcmp(key, "limit") == 0) {
+        int got = json_intField(r, &v);
+        if (got == 1 && v >= 1) query->limit = v > LIST_PAGE_MAX ? LIST_PAGE_MAX : (uint32_t)v;
+        return got < 0 ? -1 : 0;
     }
+    if (strcmp(key, "cursor") == 0) return decode_queryString(r, key, query->cursor, sizeof(query->cursor));
+    if (strcmp(key, "id_prefix") == 0) return decode_queryString(r, key, query->id_prefix, sizeof(query->id_prefix));
+    if (strcmp(key, "ip") == 0) return decode_queryString(r, key, query->ip_prefix, sizeof(query->ip_prefix));
+    return json_skipValue(r);
+}
+
+typedef struct messageDecoder {
+    PROTOCOL_MESSAGE* msg;
+    char* type; // Looked up once the whole object is read, for the error messages
+    size_t type_len;
+    char* content;
+    size_t content_len;
+    char* selectedClient;
+    connectionQuery query; // Copied out only for REQUEST : CONNECTION_LIST
+    int has_query;
+} messageDecoder;
 
-    cJSON* clientID_size = cJSON_GetObjectItem(jsonStruct, "client_size");
-    if (cJSON_IsNumber(clientID_size)) {
-        msgStruct->clientID_size = clientID_size->valueint;
+static int decode_messageField(jsonReader* r, const char* key, void* ctx) {
+    messageDecoder* d = ctx;
+    PROTOCOL_MESSAGE* msg = d->msg;
+    size_t len;
+    int64_t v;
+    int got;
+
+    switch (key[0]) { // Most keys are told apart by their first letter
+        case 't':
+            if (strcmp(key, "type") == 0) return json_strField(r, &d->type, &d->type_len) < 0 ? -1 : 0;
+            if (strcmp(key, "timeout_ms") == 0) {
+                got = json_intField(r, &v);
+                if (got == 1 && v >= 1 && v <= UINT32_MAX) msg->timeout_ms = (uint32_t)v;
+                return got < 0 ? -1 : 0;
+            }
+            break;
+        case 'c':
+            if (strcmp(key, "content") == 0) return json_strField(r, &d->content, &d->content_len) < 0 ? -1 : 0;
+            break; // client_size is informational, skipped
+        case 'd':
+            if (strcmp(key, "destination") == 0) return json_strField(r, &msg->destination, &len) < 0 ? -1 : 0;
+            break;
+        case 's':
+            if (strcmp(key, "source") == 0) return json_strField(r, &msg->source, &len) < 0 ? -1 : 0;
+            if (strcmp(key, "selectedClient") == 0) return json_strField(r, &d->selectedClient, &len) < 0 ? -1 : 0;
+            break;
+        case 'r':
+            if (strcmp(key, "request_id") == 0) {
+                got = json_intField(r, &v);
+                if (got == 1 && v > 0 && v <= UINT32_MAX) msg->request_id = (uint32_t)v;
+                return got < 0 ? -1 : 0;
+            }
+            break;
+        case 'p':
+            if (strcmp(key, "payload") == 0) {
+                got = json_strField(r, &msg->payload, &len);
+                if (got == 1 && len >= BUFFER_SIZE) {
+                    fprintf(stderr, "[ERROR] [protocolhandler/decode_messageField] Payload exceeds buffer size: %zu >= %d\n", len, BUFFER_SIZE);
+                    return -1;
+                }
+                return got < 0 ? -1 : 0;
+            }
+            if (strcmp(key, "payload_size") == 0) {
+                got = json_intField(r, &v);
+                if (got == 1 && v >= INT_MIN && v <= INT_MAX) msg->payload_size = (int)v;
+                return got < 0 ? -1 : 0;
+            }
+            break;
+        case 'q':
+            if (strcmp(key, "query") == 0) {
+                json_skipWs(r);
+                if (r->p >= r->end || *r->p != '{') return json_skipValue(r);
+                d->has_query = 1;
+                return json_object(r, decode_queryField, &d->query);
+            }
+            break;
+        default:
+            break;
     }
+    return json_skipValue(r);
+}
 
-    cJSON* payload = cJSON_GetObjectItem(jsonStruct, "payload");
-    if (cJSON_IsString(payload)) {
-        msgStruct->payload = malloc(BUFFER_SIZE);
-        if (msgStruct->payload_size >= BUFFER_SIZE)
-            printf("[POSSIBLE ERROR] Received payload size may cause buffer overflow. [payload_size = %d | %d]", msgStruct->payload_size, BUFFER_SIZE);
-        if (!msgStruct->payload){
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct->payload\n");
-            delete_protocol_msg(msgStruct);
-            return NULL;
-        }
+PROTOCOL_MESSAGE* parse_message(char* json, size_t len) {
+    PROTOCOL_MESSAGE* msgStruct = pool_alloc(&protocolMsg_pool);
+    if (!msgStruct) {
+        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for msgStruct\n");
+        return NULL;
+    }
+    msgStruct->destination = NULL;
+    msgStruct->source = NULL;
+    msgStruct->specifiedClient = 0;
+    msgStruct->request_id = 0;
+    msgStruct->timeout_ms = 0;
+    msgStruct->content_type = CONTENT_TYPE_NONE;
+    msgStruct->payload = NULL;
+    msgStruct->payload_size = 0;
+    msgStruct->query = NULL;
+    msgStruct->borrowed = 1; // Strings point into json
 
-        int n = snprintf(msgStruct->payload, BUFFER_SIZE, "%s", payload->valuestring);
-        if (n >= BUFFER_SIZE) {
-            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Payload exceeds buffer size: %d >= %d\n", n, BUFFER_SIZE);
-            printf("TRUNCATED PAYLOAD: \n %s \n", msgStruct->payload);
+    messageDecoder d = { .msg = msgStruct };
+    jsonReader r = { .p = json, .end = json + len };
+    if (json_object(&r, decode_messageField, &d) != 0) {
+        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] JSON Parse Error at offset %td\n", r.p - json);
+        delete_protocol_msg(msgStruct);
+        return NULL;
+    }
+
+    if (!d.type) {
+        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Missing or invalid 'type'\n");
+        delete_protocol_msg(msgStruct);
+        return NULL;
+    }
+    msgStruct->msg_type = type_lookup(msgTypeTable, msgTypeNames, d.type, d.type_len);
+    if (!msgStruct->msg_type) {
+        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Invalid message type: %s\n", d.type);
+        delete_protocol_msg(msgStruct);
+        return NULL;
+    }
+    if (d.content && !(msgStruct->content_type = type_lookup(contentTypeTable, contentTypeNames, d.content, d.content_len))) {
+        fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Invalid content type: %s\n", d.content);
+        delete_protocol_msg(msgStruct);
+        return NULL;
+    }
+    if (d.selectedClient) {
+        msgStruct->specifiedClient = client_parseId(d.selectedClient); // Text form ends here
+        if (!msgStruct->specifiedClient)
+            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Invalid selectedClient: %s\n", d.selectedClient);
+    }
+
+    if (d.has_query && msgStruct->msg_type == REQUEST && msgStruct->content_type == CONNECTION_LIST) {
+        msgStruct->query = pool_bufAlloc(sizeof(connectionQuery));
+        if (!msgStruct->query) {
+            fprintf(stderr, "[ERROR] [protocolhandler/parse_message] Error at allocating memory for query\n");
             delete_protocol_msg(msgStruct);
-            cJSON_Delete(jsonStruct);
             return NULL;
         }
+        *msgStruct->query = d.query;
     }
 
     switch(msgStruct->msg_type) {
         case COMMAND:
-            if (!msgStruct->specifiedClient_id || !msgStruct->payload) {
+            if (!msgStruct->specifiedClient || !msgStruct->payload) {
                 fprintf(stderr, "[ERROR] [protocolhandler/parse_message] COMMAND message missing required fields\n");
                 delete_protocol_msg(msgStruct);
-                cJSON_Delete(jsonStruct);
                 return NULL;
             }
             break;
@@ -226,22 +562,23 @@ PROTOCOL_MESSAGE* parse_message(char* jsonString) {
             break;
     }
 
-    cJSON_Delete(jsonStruct);
     return msgStruct;
 }
 
 
 
-void handle_received_message(char* received_jsonMsg) {
-    PROTOCOL_MESSAGE* msg = parse_message(received_jsonMsg);
+void handle_received_message(char* received_jsonMsg, size_t len) {
+    PROTOCOL_MESSAGE* msg = parse_message(received_jsonMsg, len);
     if (!msg) {
-        fprintf(stderr, "[ERROR] [protocolhandler/handle_received_message] Failed to parse message: %s\n", received_jsonMsg);
+        fprintf(stderr, "[ERROR] [protocolhandler/handle_received_message] Failed to parse message (%zu bytes)\n", len); // Partly unescaped by now
         // sendtowebsocket("message was dropped (failure to parse)")
         return;
     }
 
-    if (strcmp(msg->source, CSERVER) == 0)
+    if (msg->source && strcmp(msg->source, CSERVER) == 0) {
+        delete_protocol_msg(msg);
         return;
+    }
 
     // Some need enforcing payload field to be present
     switch (msg->msg_type) {
@@ -255,7 +592,8 @@ void handle_received_message(char* received_jsonMsg) {
             // protocol_handle_beacon()
             break;
         case REQUEST:
-            // protocol_handle_request()
+            if (msg->content_type == CONNECTION_LIST) // Dashboard page, or initial load / resync after a gap in the deltas
+                protocol_handle_listupdate(msg);
             break;
         case RESPONSE:
             // protocol_handle_response()
@@ -264,8 +602,8 @@ void handle_received_message(char* received_jsonMsg) {
             // protocol_handle_selectclient()
             break; // Fixed missing break
         case COMMAND:
-            // protocol_handle_command()
-            break;
+            protocol_handle_command(msg); // Pushes to the client's command_queue, takes ownership of msg
+            return;
         case LIST_UPDATE: // Shouldn't actually be received, only C SERVER sends LIST_UPDATE messages, REACTFRONT sends REQUEST with CONNECTION_LIST as content type
             // protocol_handle_listupdate()
             break;
@@ -279,18 +617,18 @@ void handle_received_message(char* received_jsonMsg) {
 
 int protocol_handle_command(PROTOCOL_MESSAGE* msg) {
 
-    if (!msg->specifiedClient_id) {
+    if (!msg->specifiedClient) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] Received command frame does not specify a client\n");
         // Send error back
         // Eventually include code that resorts to executing the command for selectedClient that exists in server.c since the frame does not have one
         delete_protocol_msg(msg);
         return 1;
     }
-    // Grab the specified client in the frame
-    client* specifiedClient = hash_grab(clientHash, msg->specifiedClient_id);
+    // Grab the specified client in the frame, its queue stays valid until client_release() even if it disconnects
+    client* specifiedClient = slot_grab(clientSlots, msg->specifiedClient);
 
     if (specifiedClient == NULL) {
-        fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] Could not find specified client\n");
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] Could not find specified client " CLIENT_ID_FMT " (stale or unknown)\n", msg->specifiedClient);
         // Send error back
         delete_protocol_msg(msg);
         return 1;
@@ -299,133 +637,400 @@ int protocol_handle_command(PROTOCOL_MESSAGE* msg) {
     if (!msg->payload) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] Received command frame does not include a payload\n");
         // Send error back
+        client_release(specifiedClient);
         delete_protocol_msg(msg);
         return 1;
     }
-    // Push received command to specified client's command queue
-    queueNode* node = queue_createNode(msg->payload);
+    if (!msg->request_id) // Still correlate it, the dashboard sees the ID on the RESPONSE
+        msg->request_id = PROTOCOL_SERVER_REQUEST_ID | (atomic_fetch_add(&next_request_id, 1) & ~PROTOCOL_SERVER_REQUEST_ID);
+
+    // Push the command to the specified client's command queue as a ready-to-send wire frame, the agent echoes request_id
+    uint32_t timeout_ms = msg->timeout_ms ? msg->timeout_ms : PROTOCOL_COMMAND_TIMEOUT_MS;
+    size_t len = WIRE_DEADLINE_SIZE + strlen(msg->payload);
+    char* frame = pool_bufAlloc(WIRE_HEADER_SIZE + len);
+    queueNode* node = frame ? queue_createNode(frame, WIRE_HEADER_SIZE + len) : NULL; // Queue owns frame from here on
 
     if (!node) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] queue_createNode error\n");
+        pool_bufFree(frame);
+        client_release(specifiedClient);
         delete_protocol_msg(msg);
         return 1;
     }
+    wire_encodeHeader((unsigned char*)frame, WIRE_COMMAND, msg->request_id, len);
+    wire_put32((unsigned char*)frame + WIRE_HEADER_SIZE, timeout_ms); // The agent kills the command past the same deadline
+    memcpy(frame + WIRE_HEADER_SIZE + WIRE_DEADLINE_SIZE, msg->payload, len - WIRE_DEADLINE_SIZE);
+
+    // Tracked before it is queued: a worker may send it & the agent's WIRE_OUTPUT_END come back before queue_push() returns
+    int tracked = protocol_track_command(specifiedClient, msg->request_id, timeout_ms) == 0;
+    if (!tracked)
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] Command %u sent without a deadline\n", msg->request_id);
     if (queue_push(specifiedClient->command_queue, node) != 0) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_handle_command] queue_push error\n");
+        if (tracked) protocol_complete_command(specifiedClient, msg->request_id); // Never sent, no CMD_TIMEOUT for it
+        queue_deleteNode(node);
+        client_release(specifiedClient);
         delete_protocol_msg(msg);
         return 1;
     }
 
+    client_release(specifiedClient);
     delete_protocol_msg(msg);
     return 0;
 }
 
-int protocol_handle_listupdate() {
-    if (websocket_send_connectionsList(websocket_global_wss, clientHash) != 0)
+// Unlinks cmd from its client's pending list, 0 if it was already gone (completed or dropped)
+static int pending_unlink(client* cli, pendingCommand* cmd) {
+    for (pendingCommand** pp = &cli->pending; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == cmd) {
+            *pp = cmd->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void pending_free(pendingCommand* cmd) {
+    client_release(cmd->cli);
+    pool_free(&pendingCmd_pool, cmd);
+}
+
+static void protocol_send_timeout(pendingCommand* cmd) {
+    char payload[64];
+    int len = snprintf(payload, sizeof(payload), "Command timed out after %u ms", cmd->timeout_ms);
+    PROTOCOL_MESSAGE msg = {
+        .msg_type = RESPONSE, .content_type = CMD_TIMEOUT,
+        .destination = REACTFRONT, .source = CSERVER,
+        .payload = payload, .payload_size = len,
+        .specifiedClient = cmd->cli->handle, .request_id = cmd->request_id,
+    };
+    size_t jsonLen;
+    char* jsonMsg = protocol_create_jsonMsg(&msg, &jsonLen);
+    if (!jsonMsg || websocket_push_output(websocket_global_wss, jsonMsg, jsonLen, 0) != 0) { // On the epoll loop, never waits for room
+        pool_bufFree(jsonMsg);
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_send_timeout] Failed to report the timeout of command %u\n", cmd->request_id);
+    }
+}
+
+// Runs on the reactor's epoll loop, or on wheel_destroy() with expired = 0
+static void on_command_timeout(timerNode* node, int expired) {
+    pendingCommand* cmd = (pendingCommand*)node;
+    client* cli = cmd->cli;
+
+    pthread_mutex_lock(&cli->pending_mutex);
+    int tracked = pending_unlink(cli, cmd);
+    pthread_mutex_unlock(&cli->pending_mutex);
+
+    if (tracked && expired) {
+        printf("Command %u on " CLIENT_ID_FMT " timed out after %u ms\n", cmd->request_id, cli->handle, cmd->timeout_ms);
+        protocol_send_timeout(cmd);
+    }
+    pending_free(cmd);
+}
+
+int protocol_track_command(client* cli, uint32_t request_id, uint32_t timeout_ms) {
+    pendingCommand* cmd = pool_alloc(&pendingCmd_pool);
+    if (!cmd) {
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_track_command] Failed to allocate memory for pendingCommand\n");
+        return 1;
+    }
+    wheel_nodeInit(&cmd->timer, on_command_timeout);
+    client_acquire(cli);
+    cmd->cli = cli;
+    cmd->request_id = request_id;
+    cmd->timeout_ms = timeout_ms;
+
+    pthread_mutex_lock(&cli->pending_mutex);
+    if (wheel_schedule(server_wheel, &cmd->timer, timeout_ms) != 0) { // Shutting down
+        pthread_mutex_unlock(&cli->pending_mutex);
+        pending_free(cmd);
         return 1;
+    }
+    cmd->next = cli->pending;
+    cli->pending = cmd;
+    pthread_mutex_unlock(&cli->pending_mutex);
     return 0;
 }
 
-char* create_error_jsonMsg(const char* error_msg) {
-    size_t jsonSize = strlen(error_msg) + 50; // Extra space for JSON structure
-    char* jsonError = malloc(jsonSize);
+void protocol_complete_command(client* cli, uint32_t request_id) {
+    pendingCommand* done = NULL;
+    pthread_mutex_lock(&cli->pending_mutex);
+    for (pendingCommand* cmd = cli->pending; cmd != NULL; cmd = cmd->next) {
+        if (cmd->request_id == request_id) {
+            pending_unlink(cli, cmd);
+            if (wheel_cancel(server_wheel, &cmd->timer)) done = cmd; // Otherwise its callback is about to run & frees it
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cli->pending_mutex);
+    if (done) pending_free(done); // The caller's own reference keeps this from being the last one
+}
+
+void protocol_drop_commands(client* cli) {
+    pendingCommand* dropped = NULL;
+    pthread_mutex_lock(&cli->pending_mutex);
+    while (cli->pending != NULL) {
+        pendingCommand* cmd = cli->pending;
+        cli->pending = cmd->next;
+        if (wheel_cancel(server_wheel, &cmd->timer)) {
+            cmd->next = dropped;
+            dropped = cmd;
+        }
+    }
+    pthread_mutex_unlock(&cli->pending_mutex);
+
+    while (dropped != NULL) {
+        pendingCommand* cmd = dropped;
+        dropped = cmd->next;
+        pending_free(cmd);
+    }
+}
+
+int protocol_handle_listupdate(PROTOCOL_MESSAGE* msg) {
+    if (msg->query)
+        return websocket_send_connectionsPage(websocket_global_wss, clientSlots, msg->query, msg->request_id) != 0;
+    if (websocket_send_connectionsList(websocket_global_wss, clientSlots) != 0)
+        return 1;
+    return 0;
+}
+
+/*
+ *
+ * MESSAGE ENCODER:
+ * ONE PASS SIZES THE ENVELOPE, THE NEXT WRITES IT STRAIGHT INTO ONE POOL BUFFER, NO cJSON TREE, NO PRINT, NO COPY
+ *
+ *      THE JSON STARTS AT buffer + LWS_PRE, THE WEB THREAD WRITES THE FRAME HEADER INTO THAT HEADROOM & MASKS IN PLACE
+ *      STRINGS ARE ESCAPED LIKE cJSON DOES ('"', '\\' & CONTROL CHARACTERS, OTHER BYTES AS-IS), KEYS IN THE SAME ORDER
+ *      THE PAYLOAD IS payload_size BYTES, IT NEEDS NO NUL & MAY CONTAIN ONE (SENT AS \u0000, cJSON CUT THE STRING THERE)
+ *
+ * A RESPONSE COSTS ONE BUFFER FROM ENQUEUE TO lws_write(), THE OUTBOUND RING HANDS IT BACK TO pool_bufFree() ONCE SENT
+ *
+ */
+#define JSON_ENVELOPE_MAX 256 // Keys, quotes, selectedClient & the three numbers, the strings are sized on top
+#define JSON_PUT_LITERAL(w, lit) json_putRaw((w), (lit), sizeof(lit) - 1)
+
+static inline int json_needsEscape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+// First byte from s that must be escaped, end if none, 8 bytes per step like json_scanShort()
+static const char* json_plainRun(const char* s, const char* end) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - s >= 8) {
+        uint64_t x;
+        memcpy(&x, s, 8);
+        uint64_t quote = x ^ (JSON_ONES * '"');
+        uint64_t slash = x ^ (JSON_ONES * '\\');
+        uint64_t hit = (((quote - JSON_ONES) & ~quote) | ((slash - JSON_ONES) & ~slash) | ((x - JSON_ONES * 0x20) & ~x)) & JSON_HIGHS;
+        if (hit) return s + (__builtin_ctzll(hit) >> 3);
+        s += 8;
+    }
+#endif
+    while (s < end && !json_needsEscape((unsigned char)*s)) s++;
+    return s;
+}
+
+static size_t json_escapedLen(const char* s, size_t len) {
+    const char* end = s + len;
+    size_t out = len;
+    while ((s = json_plainRun(s, end)) < end) {
+        switch ((unsigned char)*s++) {
+            case '"': case '\\': case '\b': case '\f': case '\n': case '\r': case '\t': out += 1; break;
+            default: out += 5; break; // \u00XX
+        }
+    }
+    return out;
+}
+
+static inline char* json_putRaw(char* w, const char* s, size_t len) {
+    memcpy(w, s, len);
+    return w + len;
+}
+
+static char* json_putEscaped(char* w, const char* s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char* end = s + len;
+    while (s < end) {
+        const char* run = s;
+        s = json_plainRun(s, end);
+        w = json_putRaw(w, run, s - run); // Plain bytes are copied a run at a time
+        if (s == end) break;
+        unsigned char c = *s++;
+        *w++ = '\\';
+        switch (c) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '\b': *w++ = 'b'; break;
+            case '\f': *w++ = 'f'; break;
+            case '\n': *w++ = 'n'; break;
+            case '\r': *w++ = 'r'; break;
+            case '\t': *w++ = 't'; break;
+            default:
+                *w++ = 'u';
+                *w++ = '0';
+                *w++ = '0';
+                *w++ = hex[c >> 4];
+                *w++ = hex[c & 0xF];
+                break;
+        }
+    }
+    return w;
+}
+
+static char* json_putString(char* w, const char* s, size_t len) {
+    *w++ = '"';
+    w = json_putEscaped(w, s, len);
+    *w++ = '"';
+    return w;
+}
+
+static char* json_putUint(char* w, uint32_t v) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n) *w++ = digits[--n];
+    return w;
+}
+
+static char* create_error_jsonMsg(const char* error_msg, size_t* len) {
+    static const char head[] = "{\"type\": \"ERROR\", \"payload\": ";
+    size_t msgLen = strlen(error_msg);
+    char* jsonError = pool_bufAlloc(LWS_PRE + sizeof(head) + json_escapedLen(error_msg, msgLen) + 3);
     if (!jsonError) {
         fprintf(stderr, "[ERROR] [protocolhandler/create_error_jsonMsg] Failed to allocate memory for jsonError\n");
         return NULL;
     }
-    snprintf(jsonError, jsonSize, "{\"type\": \"ERROR\", \"payload\": \"%s\"}", error_msg);
+    char* w = JSON_PUT_LITERAL(jsonError + LWS_PRE, head);
+    w = json_putString(w, error_msg, msgLen); // Escaped, a quote in error_msg used to break the JSON
+    *w++ = '}';
+    *w = '\0';
+    *len = w - (jsonError + LWS_PRE);
     return jsonError;
 }
+
 PROTOCOL_MESSAGE* protocol_create_msg(enum PROTOCOL_MESSAGE_TYPES type,
                                       enum PROTOCOl_CONTENT_TYPE content_type,
                                       char* dest, char* src,
-                                      char* clientID, char* payload,
-                                      int clientID_size, int payload_size)
+                                      clientHandle clientID, char* payload,
+                                      int payload_size)
 {
-    PROTOCOL_MESSAGE* msg = malloc(sizeof(PROTOCOL_MESSAGE));
+    PROTOCOL_MESSAGE* msg = pool_alloc(&protocolMsg_pool);
 
     if (!msg) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_msg] Failed to allocate memory for PROTOCOL_MESSAGE* msg");
+        return NULL;
     }
 
-    msg->payload = malloc(payload_size + 1);
+    msg->payload = pool_bufAlloc(payload_size + 1);
     if (!msg->payload) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_msg] Failed to allocate memory for payload\n");
-        free(msg);
+        pool_free(&protocolMsg_pool, msg);
         return NULL;
     }
-    msg->specifiedClient_id = malloc(clientID_size + 1);
-    if (!msg->specifiedClient_id) {
-        fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_msg] Failed to allocate memory for specifiedClient_id\n");
-        free(msg->payload);
-        free(msg->specifiedClient_id);
-        free(msg);
-        return NULL;
-    }
-
-    msg->destination = malloc(strlen(dest) + 1);
+    msg->destination = pool_bufAlloc(strlen(dest) + 1);
     if (!msg->destination) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_msg] Failed to allocate memory for msg->destination\n");
-        free(msg->payload);
-        free(msg);
+        pool_bufFree(msg->payload);
+        pool_free(&protocolMsg_pool, msg);
         return NULL;
     }
-    msg->source = malloc(strlen(src) + 1);
+    msg->source = pool_bufAlloc(strlen(src) + 1);
     if (!msg->source) {
         fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_msg] Failed to allocate memory for msg->source\n");
-        free(msg->payload);
-        free(msg->specifiedClient_id);
-        free(msg->destination);
-        free(msg);
+        pool_bufFree(msg->payload);
+        pool_bufFree(msg->destination);
+        pool_free(&protocolMsg_pool, msg);
         return NULL;
     }
     msg->msg_type = type;
     msg->content_type = content_type;
-    msg->clientID_size = clientID_size;
-    msg->source = src;
+    msg->specifiedClient = clientID;
+    msg->request_id = 0;
+    msg->timeout_ms = 0;
+    msg->query = NULL;
+    msg->borrowed = 0;
     msg->payload_size = payload_size;
     snprintf(msg->source, strlen(src) + 1, "%s", src);
     snprintf(msg->destination, strlen(dest) + 1, "%s", dest);
     snprintf(msg->payload, payload_size + 1, "%s", payload);
-    snprintf(msg->specifiedClient_id, clientID_size + 1, "%s", clientID);
 
     return msg;
 }
 
-char* protocol_create_jsonMsg(PROTOCOL_MESSAGE* msg) {
-    cJSON* json = cJSON_CreateObject();
-    if (!json) {
-        fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_jsonMsg] Failed to create cJSON object\n");
+char* protocol_create_jsonMsg(const PROTOCOL_MESSAGE* msg, size_t* len) {
+    const protocolName* type = protocol_msgTypeName(msg->msg_type);
+    const protocolName* content = protocol_contentTypeName(msg->content_type);
+    if (!type || !content) {
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_jsonMsg] Invalid message type %d or content type %d\n", msg->msg_type, msg->content_type);
         return NULL;
     }
+    size_t destLen = msg->destination ? strlen(msg->destination) : 0;
+    size_t srcLen = msg->source ? strlen(msg->source) : 0;
+    size_t payloadLen = msg->payload && msg->payload_size > 0 ? (size_t)msg->payload_size : 0;
 
-    cJSON_AddStringToObject(json, "type", msgTypes[msg->msg_type - 1].str);
-    cJSON_AddStringToObject(json, "content", contentTypes[msg->content_type - 1].str);
-    if (msg->destination) cJSON_AddStringToObject(json, "destination", msg->destination);
-    if (msg->source) cJSON_AddStringToObject(json, "source", msg->source);
-    if (msg->specifiedClient_id) cJSON_AddStringToObject(json, "selectedClient", msg->specifiedClient_id);
-    if (msg->payload) cJSON_AddStringToObject(json, "payload", msg->payload);
-    cJSON_AddNumberToObject(json, "payload_size", msg->payload_size);
-    cJSON_AddNumberToObject(json, "client_size", msg->clientID_size);
-
-    char* jsonStr = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
+    size_t size = LWS_PRE + JSON_ENVELOPE_MAX + type->len + content->len
+                + json_escapedLen(msg->destination, destLen)
+                + json_escapedLen(msg->source, srcLen)
+                + json_escapedLen(msg->payload, payloadLen);
+    char* jsonStr = pool_bufAlloc(size);
     if (!jsonStr) {
-        fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_jsonMsg] Failed to print cJSON to string\n");
+        fprintf(stderr, "[ERROR] [protocolhandler/protocol_create_jsonMsg] Failed to allocate %zu bytes for the message\n", size);
         return NULL;
     }
-    return jsonStr; // Caller must free
+
+    char* w = JSON_PUT_LITERAL(jsonStr + LWS_PRE, "{\"type\":");
+    w = json_putString(w, type->str, type->len);
+    w = JSON_PUT_LITERAL(w, ",\"content\":");
+    w = json_putString(w, content->str, content->len);
+    if (msg->destination) {
+        w = JSON_PUT_LITERAL(w, ",\"destination\":");
+        w = json_putString(w, msg->destination, destLen);
+    }
+    if (msg->source) {
+        w = JSON_PUT_LITERAL(w, ",\"source\":");
+        w = json_putString(w, msg->source, srcLen);
+    }
+    int clientID_size = 0;
+    if (msg->specifiedClient) {
+        char clientID[CLIENT_ID_MAX];
+        clientID_size = client_formatId(msg->specifiedClient, clientID, sizeof(clientID));
+        w = JSON_PUT_LITERAL(w, ",\"selectedClient\":");
+        w = json_putString(w, clientID, clientID_size);
+    }
+    if (msg->request_id) {
+        w = JSON_PUT_LITERAL(w, ",\"request_id\":");
+        w = json_putUint(w, msg->request_id);
+    }
+    if (msg->payload) {
+        w = JSON_PUT_LITERAL(w, ",\"payload\":");
+        w = json_putString(w, msg->payload, payloadLen);
+    }
+    w = JSON_PUT_LITERAL(w, ",\"payload_size\":");
+    w = json_putUint(w, msg->payload_size > 0 ? msg->payload_size : 0);
+    w = JSON_PUT_LITERAL(w, ",\"client_size\":");
+    w = json_putUint(w, clientID_size);
+    *w++ = '}';
+    *w = '\0'; // Not sent, keeps the message printable
+
+    *len = w - (jsonStr + LWS_PRE);
+    return jsonStr; // Caller owns it, pool_bufFree() (or hand it to websocket_push_output())
 }
 
 int protocol_send_error(websocket_service* wss, char* error_msg) {
-    char * jsonError = create_error_jsonMsg(error_msg);
+    size_t len;
+    char* jsonError = create_error_jsonMsg(error_msg, &len);
     if (!jsonError) {
         return 1;
     }
 
-    int result = websocket_send(wss, jsonError);
-    free(jsonError);
-    return result;
+    if (websocket_push_output(wss, jsonError, len, 0) != 0) { // Any thread, an error must not wait behind outputs
+        pool_bufFree(jsonError);
+        return 1;
+    }
+    return 0;
 } // To be made after refactoring server.c, so we can send_raw_message() in here by including the new header for refactored websocket functions
 
 /*
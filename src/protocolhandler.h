@@ -7,6 +7,7 @@
 
 
 #include "common.h"
+#include "client_mgmt.h"
 #include "websocket.h"
 
 
@@ -14,23 +15,50 @@
 #define WEBSERVER "WEBSOCK"
 #define REACTFRONT "FRONTEND"
 
+#define PROTOCOL_SERVER_REQUEST_ID 0x80000000u // Set on request IDs the server assigns to COMMANDs sent without one
+#define PROTOCOL_COMMAND_TIMEOUT_MS 60000 // Deadline of a COMMAND without a "timeout_ms" of its own
+
+
+/*
+ *
+ * PROTOCOL TYPES:
+ * ONE X-MACRO LIST PER KIND, THE JSON NAME OF A TYPE IS ITS ENUMERATOR'S NAME
+ *
+ *      THE ENUM, THE NAME TABLES THE ENCODER WRITES FROM & THE HASH TABLES THE DECODER LOOKS UP ARE ALL GENERATED FROM IT
+ *      A TYPE IS ADDED HERE & NOWHERE ELSE, A DUPLICATE NAME IS A DUPLICATE ENUMERATOR, SO A COMPILE ERROR
+ *
+ */
+#define PROTOCOL_MESSAGE_TYPES_LIST(X) \
+    X(CONNECT)        /* Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE */ \
+    X(BEACON)         /* Sent by CLIENT */ \
+    X(DISCONNECT)     /* Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE */ \
+    X(REQUEST) \
+    X(RESPONSE) \
+    X(SELECT_CLIENT)  /* Sent by REACT FRONTEND to C SERVER */ \
+    X(COMMAND)        /* Sent by REACT FRONTEND to C SERVER */ \
+    X(LIST_UPDATE)    /* Sent by C SERVER to REACT FRONTEND */
+
+#define PROTOCOL_CONTENT_TYPES_LIST(X) \
+    X(CMD_OUTPUT)        /* One chunk of a command's output, in order, tagged with request_id */ \
+    X(CONNECTION_LIST) \
+    X(CMD_OUTPUT_START)  /* Command started on the agent, no payload */ \
+    X(CMD_OUTPUT_END)    /* Command finished, payload is its exit status */ \
+    X(CMD_ERROR_OUTPUT)  /* One chunk of a command's stderr, ordered with the other stderr chunks only */ \
+    X(CMD_TIMEOUT)       /* Command missed its deadline, later output for its request_id may still follow */ \
+    X(CONNECTION_DELTA)  /* Registry change log events since the previous LIST_UPDATE, see websocket.c */
+
+#define PROTOCOL_ENUMERATOR(name) name,
 
 enum PROTOCOL_MESSAGE_TYPES {
-    CONNECT = 1, // Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE
-    BEACON, // Sent by CLIENT
-    DISCONNECT, // Sent by CLIENT to C SERVER, C SERVER sends LIST_UPDATE
-
-    REQUEST,
-    RESPONSE,
-
-    SELECT_CLIENT, // Sent by REACT FRONTEND to C SERVER
-    COMMAND, // Sent by REACT FRONTEND to C SERVER
-    LIST_UPDATE, // Sent by C SERVER to REACT FRONTEND
+    MSG_TYPE_NONE = 0, // Not decoded (yet)
+    PROTOCOL_MESSAGE_TYPES_LIST(PROTOCOL_ENUMERATOR)
+    MSG_TYPE_COUNT
 };
 
 enum PROTOCOl_CONTENT_TYPE {
-    CMD_OUTPUT = 1,
-    CONNECTION_LIST,
+    CONTENT_TYPE_NONE = 0, // No "content"
+    PROTOCOL_CONTENT_TYPES_LIST(PROTOCOL_ENUMERATOR)
+    CONTENT_TYPE_COUNT
 };
 
 typedef struct PROTOCOL_MESSAGE {
@@ -43,39 +71,67 @@ typedef struct PROTOCOL_MESSAGE {
     char* payload;
     int payload_size;
 
-    char* specifiedClient_id;
-    int clientID_size;
+    clientHandle specifiedClient; // 0 if none, written/read as "cliN" only in the JSON
+    uint32_t request_id; // Ties a COMMAND to its RESPONSE, carried in the agent wire frames, 0 if none
+    uint32_t timeout_ms; // COMMAND deadline, 0 for PROTOCOL_COMMAND_TIMEOUT_MS
+    connectionQuery* query; // REQUEST : CONNECTION_LIST paging & filters, NULL for the full snapshot
+    int borrowed; // parse_message(): destination, source & payload point into the received buffer, not freed
 } PROTOCOL_MESSAGE;
 
+/*
+ *
+ * COMMAND DEADLINES:
+ * EVERY COMMAND PUSHED TO AN AGENT IS TRACKED ON ITS client UNTIL ITS WIRE_OUTPUT_END, WITH A TIMER ON server_wheel
+ *
+ *      THE DEADLINE FIRING FIRST SENDS A RESPONSE : CMD_TIMEOUT TO THE FRONTEND
+ *      THE AGENT GETS THE SAME DEADLINE IN THE WIRE_COMMAND & KILLS THE COMMAND ITSELF, ITS WIRE_OUTPUT_END (137) FOLLOWS
+ *      A DISCONNECTION DROPS THE CLIENT'S PENDING COMMANDS SILENTLY
+ *
+ */
+typedef struct pendingCommand {
+    timerNode timer; // First member, the wheel hands it back to the timeout callback
+    client* cli; // Referenced while tracked
+    uint32_t request_id;
+    uint32_t timeout_ms;
+    struct pendingCommand* next; // cli->pending
+} pendingCommand;
+
+
+typedef struct protocolName {
+    const char* str;
+    size_t len;
+} protocolName;
 
-typedef struct contentMap {
-    char* str;
-    enum PROTOCOl_CONTENT_TYPE enu;
-} contentMap;
+const protocolName* protocol_msgTypeName(enum PROTOCOL_MESSAGE_TYPES type); // NULL if out of range
 
-typedef struct messageTypeMap {
-    char* str;
-    enum PROTOCOL_MESSAGE_TYPES enu;
-} messageTypeMap;
+const protocolName* protocol_contentTypeName(enum PROTOCOl_CONTENT_TYPE type);
 
 
 void delete_protocol_msg(PROTOCOL_MESSAGE* msg);
 
-PROTOCOL_MESSAGE* parse_message(char* jsonString);
+PROTOCOL_MESSAGE* parse_message(char* json, size_t len); // Decodes json in place, the message borrows from it
 
-void handle_received_message(char* received_jsonMsg);
+void handle_received_message(char* received_jsonMsg, size_t len);
 
 int protocol_handle_command(PROTOCOL_MESSAGE* msg);
 
+int protocol_handle_listupdate(PROTOCOL_MESSAGE* msg); // REQUEST : CONNECTION_LIST, a page if msg has a query, else the snapshot
+
+int protocol_track_command(client* cli, uint32_t request_id, uint32_t timeout_ms);
+
+void protocol_complete_command(client* cli, uint32_t request_id); // WIRE_OUTPUT_END received, cancels the deadline
+
+void protocol_drop_commands(client* cli); // Disconnection, cancels every deadline of the client
+
 int create_error_msg(char* error_msg);
 
 PROTOCOL_MESSAGE* protocol_create_msg(enum PROTOCOL_MESSAGE_TYPES type,
                                       enum PROTOCOl_CONTENT_TYPE content_type,
                                       char* dest, char* src,
-                                      char* clientID, char* payload,
-                                      int clientID_size, int payload_size);
+                                      clientHandle clientID, char* payload,
+                                      int payload_size);
 
-char* protocol_create_jsonMsg(PROTOCOL_MESSAGE* msg);
+char* protocol_create_jsonMsg(const PROTOCOL_MESSAGE* msg, size_t* len); // Pool buffer, the len bytes of JSON start at + LWS_PRE
 
 int protocol_send_error(websocket_service* wss, char* error_msg);
 
@@ -0,0 +1,332 @@
+#include "reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+reactor* server_reactor = NULL;
+
+/*
+ *
+ * REACTOR:
+ * ONE EPOLL LOOP OWNS EVERY CLIENT SOCKET, A FIXED POOL OF WORKERS HANDLES THE READY ONES
+ *
+ * CLIENT SOCKETS ARE REGISTERED WITH EPOLLONESHOT:
+ *      A READABLE SOCKET IS HANDED TO EXACTLY ONE WORKER AT A TIME
+ *      THE WORKER REARMS IT ONCE IT IS DONE WITH IT (OR REMOVES IT ON DISCONNECTION)
+ *
+ * EVERY CLIENT'S command_queue->event_fd IS REGISTERED THE SAME WAY (ONESHOT):
+ *      A PUSH ON AN EMPTY QUEUE MAKES IT READABLE, A WORKER FLUSHES THE QUEUE (JOB_WRITE) & REARMS IT
+ *
+ * SOCKETS ARE NON-BLOCKING, A WORKER NEVER WAITS FOR AN AGENT THAT STOPPED READING:
+ *      cli->write_fd (A dup() OF THE SOCKET) IS REGISTERED DISARMED, ITS OWN EPOLLOUT WAIT APART FROM THE READS
+ *      WHEN send() WOULD BLOCK, THE WORKER ARMS IT INSTEAD OF THE QUEUE & RETURNS, EPOLLOUT QUEUES THE NEXT JOB_WRITE
+ *      ONLY ONE OF THE TWO IS ARMED AT A TIME, SO THERE IS STILL ONE WRITER PER CLIENT
+ *
+ * epoll_event.data.ptr IS THE client*, TAGGED WITH REACTOR_QUEUE_TAG FOR QUEUE EVENTS
+ * NOTHING POLLS, AN IDLE SERVER SLEEPS IN epoll_wait() (WAKING ONCE PER WHEEL_TICK_MS IF A TIMER WHEEL IS ATTACHED)
+ *
+ * TIMERS:
+ *      timer_fd IS REGISTERED WITH data.ptr = &r->timer_fd, THE LOOP EXPIRES THE WHEEL AFTER DISPATCHING ITS BATCH
+ *      CALLBACKS RUN ON THE LOOP THREAD, BEFORE THE PARKED CLIENTS ARE RELEASED
+ *
+ * REFERENCES:
+ *      THE REACTOR HOLDS ONE PER REGISTERED CLIENT, EVERY QUEUED JOB HOLDS ONE UNTIL ITS HANDLER RETURNS
+ *      reactor_remove() ONLY PARKS THE CLIENT: AN EVENT FETCHED BEFORE EPOLL_CTL_DEL MAY STILL BE IN THE
+ *      LOOP'S BATCH, SO THE LOOP DROPS THE REACTOR'S REFERENCE ONCE THAT BATCH IS DISPATCHED
+ *
+ */
+
+static int jobs_push(reactor* r, enum REACTOR_JOB_TYPE type, client* cli) {
+    pthread_mutex_lock(&r->jobs_mutex);
+    while (r->jobs_count == REACTOR_JOB_CAPACITY && !r->stopping)
+        pthread_cond_wait(&r->jobs_notFull, &r->jobs_mutex);
+    if (r->stopping) {
+        pthread_mutex_unlock(&r->jobs_mutex);
+        return -1;
+    }
+    int tail = (r->jobs_head + r->jobs_count) % REACTOR_JOB_CAPACITY;
+    r->jobs[tail].type = type;
+    r->jobs[tail].cli = cli;
+    r->jobs_count++;
+    pthread_cond_signal(&r->jobs_notEmpty);
+    pthread_mutex_unlock(&r->jobs_mutex);
+    return 0;
+}
+
+static int jobs_pop(reactor* r, reactorJob* job) {
+    pthread_mutex_lock(&r->jobs_mutex);
+    while (r->jobs_count == 0 && !r->stopping)
+        pthread_cond_wait(&r->jobs_notEmpty, &r->jobs_mutex);
+    if (r->jobs_count == 0) { // stopping & drained
+        pthread_mutex_unlock(&r->jobs_mutex);
+        return -1;
+    }
+    *job = r->jobs[r->jobs_head];
+    r->jobs_head = (r->jobs_head + 1) % REACTOR_JOB_CAPACITY;
+    r->jobs_count--;
+    pthread_cond_signal(&r->jobs_notFull);
+    pthread_mutex_unlock(&r->jobs_mutex);
+    return 0;
+}
+
+static void* reactor_worker(void* arg) {
+    reactor* r = (reactor*)arg;
+    reactorJob job;
+    while (jobs_pop(r, &job) == 0) {
+        if (job.type == JOB_READ)
+            r->on_readable(job.cli);
+        else
+            r->on_writable(job.cli);
+        client_release(job.cli);
+    }
+    return NULL;
+}
+
+static void reactor_releaseRemoved(reactor* r) {
+    pthread_mutex_lock(&r->removed_mutex);
+    client* cli = r->removed;
+    r->removed = NULL;
+    pthread_mutex_unlock(&r->removed_mutex);
+
+    while (cli != NULL) {
+        client* next = cli->reactor_next;
+        client_release(cli);
+        cli = next;
+    }
+}
+
+static void* reactor_loop(void* arg) {
+    reactor* r = (reactor*)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (*r->running && !r->stopping) {
+        int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (ERRNO == EINTR) continue;
+            fprintf(stderr, "[ERROR] [reactor/reactor_loop] epoll_wait() failed %d: %s\n", ERRNO, strerror(ERRNO));
+            break;
+        }
+        int ticked = 0;
+        for (int i = 0; i < n; i++) {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+            if (data == (uintptr_t)&r->timer_fd) {
+                uint64_t expirations;
+                if (read(r->timer_fd, &expirations, sizeof(expirations)) == -1 && ERRNO != EAGAIN)
+                    fprintf(stderr, "[ERROR] [reactor/reactor_loop] read() on timer_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+                ticked = 1;
+                continue;
+            }
+            if (!data) { // wake_fd, shutting down or clients were removed
+                uint64_t v;
+                if (read(r->wake_fd, &v, sizeof(v)) == -1 && ERRNO != EAGAIN)
+                    fprintf(stderr, "[ERROR] [reactor/reactor_loop] read() on wake_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+                continue;
+            }
+            enum REACTOR_JOB_TYPE type = (data & REACTOR_QUEUE_TAG) ? JOB_WRITE : JOB_READ;
+            client* cli = (client*)(data & ~(uintptr_t)REACTOR_QUEUE_TAG);
+            client_acquire(cli); // The reactor's reference is still held, it is only dropped below
+            if (jobs_push(r, type, cli) != 0) {
+                client_release(cli);
+                break;
+            }
+        }
+        if (ticked) wheel_expire(r->wheel); // Catches up on every missed tick by itself
+        reactor_releaseRemoved(r);
+    }
+    return NULL;
+}
+
+static int reactor_initTimer(reactor* r) {
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (r->timer_fd == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_initTimer] timerfd_create() failed %d: %s\n", ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    struct itimerspec tick = {
+        .it_interval = { .tv_sec = WHEEL_TICK_MS / 1000, .tv_nsec = (WHEEL_TICK_MS % 1000) * 1000000L },
+        .it_value = { .tv_sec = WHEEL_TICK_MS / 1000, .tv_nsec = (WHEEL_TICK_MS % 1000) * 1000000L },
+    };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &r->timer_fd };
+    if (timerfd_settime(r->timer_fd, 0, &tick, NULL) == -1 || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->timer_fd, &ev) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_initTimer] Failed to arm timer_fd %d: %s\n", ERRNO, strerror(ERRNO));
+        close(r->timer_fd);
+        r->timer_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+reactor* reactor_init(volatile sig_atomic_t* running, reactor_handler on_readable, reactor_handler on_writable, timerWheel* wheel) {
+    reactor* r = malloc(sizeof(reactor));
+    if (!r) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_init] Failed to allocate memory for reactor\n");
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->running = running;
+    r->on_readable = on_readable;
+    r->on_writable = on_writable;
+    r->wheel = wheel;
+    r->timer_fd = -1;
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_init] epoll_create1() failed %d: %s\n", ERRNO, strerror(ERRNO));
+        free(r);
+        return NULL;
+    }
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_init] eventfd() failed %d: %s\n", ERRNO, strerror(ERRNO));
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_init] epoll_ctl() on wake_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+        close(r->wake_fd);
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+
+    if (wheel && reactor_initTimer(r) == -1) {
+        close(r->wake_fd);
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->jobs_mutex, NULL);
+    pthread_mutex_init(&r->removed_mutex, NULL);
+    pthread_cond_init(&r->jobs_notEmpty, NULL);
+    pthread_cond_init(&r->jobs_notFull, NULL);
+
+    for (int i = 0; i < REACTOR_WORKERS; i++) {
+        if (pthread_create(&r->workers[i], NULL, reactor_worker, r) != 0) {
+            fprintf(stderr, "[ERROR] [reactor/reactor_init] Failed to create worker %d\n", i);
+            exit(1);
+        }
+    }
+    if (pthread_create(&r->loop_thread, NULL, reactor_loop, r) != 0) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_init] Failed to create epoll loop thread\n");
+        exit(1);
+    }
+    return r;
+}
+
+static int reactor_ctl(reactor* r, int op, int fd, void* data) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = data };
+    return epoll_ctl(r->epoll_fd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev);
+}
+
+int reactor_add(reactor* r, client* cli) {
+    void* queueData = (void*)((uintptr_t)cli | REACTOR_QUEUE_TAG);
+    cli->write_fd = dup(cli->socket_desc); // Closed by client_release()
+    struct epoll_event disarmed = { .events = EPOLLONESHOT, .data.ptr = queueData }; // Reports nothing, not even EPOLLHUP
+    if (cli->write_fd == -1 || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, cli->write_fd, &disarmed) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_add] Failed to register write_fd for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    if (reactor_ctl(r, EPOLL_CTL_ADD, cli->socket_desc, cli) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_add] epoll_ctl() failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, cli->write_fd, NULL);
+        return -1;
+    }
+    if (reactor_ctl(r, EPOLL_CTL_ADD, cli->command_queue->event_fd, queueData) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_add] epoll_ctl() on command_queue failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        reactor_ctl(r, EPOLL_CTL_DEL, cli->socket_desc, NULL);
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, cli->write_fd, NULL);
+        return -1;
+    }
+    client_acquire(cli);
+    return 0;
+}
+
+int reactor_rearm(reactor* r, client* cli) {
+    if (reactor_ctl(r, EPOLL_CTL_MOD, cli->socket_desc, cli) == -1) {
+        if (ERRNO == ENOENT) return -1; // Disconnected by another worker in the meantime
+        fprintf(stderr, "[ERROR] [reactor/reactor_rearm] epoll_ctl() failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_rearmQueue(reactor* r, client* cli) {
+    void* queueData = (void*)((uintptr_t)cli | REACTOR_QUEUE_TAG);
+    if (reactor_ctl(r, EPOLL_CTL_MOD, cli->command_queue->event_fd, queueData) == -1) {
+        if (ERRNO == ENOENT) return -1; // Disconnected by another worker in the meantime
+        fprintf(stderr, "[ERROR] [reactor/reactor_rearmQueue] epoll_ctl() failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_waitWritable(reactor* r, client* cli) {
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = (void*)((uintptr_t)cli | REACTOR_QUEUE_TAG) };
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, cli->write_fd, &ev) == -1) {
+        if (ERRNO == ENOENT) return -1; // Disconnected by another worker in the meantime
+        fprintf(stderr, "[ERROR] [reactor/reactor_waitWritable] epoll_ctl() failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_remove(reactor* r, client* cli) {
+    int ret = 0;
+    if (reactor_ctl(r, EPOLL_CTL_DEL, cli->socket_desc, NULL) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_remove] epoll_ctl() failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        ret = -1;
+    }
+    if (reactor_ctl(r, EPOLL_CTL_DEL, cli->command_queue->event_fd, NULL) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_remove] epoll_ctl() on command_queue failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        ret = -1;
+    }
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, cli->write_fd, NULL) == -1) {
+        fprintf(stderr, "[ERROR] [reactor/reactor_remove] epoll_ctl() on write_fd failed for " CLIENT_ID_FMT " %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&r->removed_mutex);
+    cli->reactor_next = r->removed;
+    r->removed = cli;
+    pthread_mutex_unlock(&r->removed_mutex);
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) == -1)
+        fprintf(stderr, "[ERROR] [reactor/reactor_remove] write() on wake_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+    return ret;
+}
+
+void reactor_destroy(reactor* r) {
+    if (!r) return;
+
+    pthread_mutex_lock(&r->jobs_mutex);
+    r->stopping = 1;
+    pthread_cond_broadcast(&r->jobs_notEmpty);
+    pthread_cond_broadcast(&r->jobs_notFull);
+    pthread_mutex_unlock(&r->jobs_mutex);
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) == -1)
+        fprintf(stderr, "[ERROR] [reactor/reactor_destroy] write() on wake_fd failed %d: %s\n", ERRNO, strerror(ERRNO));
+
+    pthread_join(r->loop_thread, NULL);
+    for (int i = 0; i < REACTOR_WORKERS; i++)
+        pthread_join(r->workers[i], NULL);
+
+    reactor_releaseRemoved(r);
+    pthread_mutex_destroy(&r->jobs_mutex);
+    pthread_mutex_destroy(&r->removed_mutex);
+    pthread_cond_destroy(&r->jobs_notEmpty);
+    pthread_cond_destroy(&r->jobs_notFull);
+    if (r->timer_fd != -1) close(r->timer_fd);
+    close(r->wake_fd);
+    close(r->epoll_fd);
+    free(r);
+}
@@ -0,0 +1,74 @@
+#ifndef REACTOR_H_INCLUDED
+#define REACTOR_H_INCLUDED
+
+
+#ifndef REACTOR // Include guard
+#define REACTOR
+
+#include "common.h"
+#include "client_mgmt.h"
+#include "timerwheel.h"
+#include <signal.h>
+
+#define REACTOR_WORKERS 4 // Fixed, does not grow with the number of connected clients
+#define REACTOR_MAX_EVENTS 256 // Events handled per epoll_wait() call
+#define REACTOR_JOB_CAPACITY 4096 // Bounded job ring shared by the epoll loop and the workers
+#define REACTOR_QUEUE_TAG 1 // Low bit of epoll data.ptr, set for command_queue events
+
+enum REACTOR_JOB_TYPE {
+    JOB_READ = 1, // Client socket is readable (output or disconnection)
+    JOB_WRITE, // Client's command_queue went non-empty
+};
+
+typedef struct reactorJob {
+    enum REACTOR_JOB_TYPE type;
+    client* cli;
+} reactorJob;
+
+typedef void (*reactor_handler)(client* cli);
+
+typedef struct reactor {
+    int epoll_fd;
+    int wake_fd; // eventfd, wakes the epoll loop up on shutdown & after reactor_remove()
+    int timer_fd; // timerfd, one tick every WHEEL_TICK_MS while a wheel is attached, -1 otherwise
+    timerWheel* wheel; // Expired on the epoll loop, its callbacks must not block
+
+    pthread_t loop_thread;
+    pthread_t workers[REACTOR_WORKERS];
+
+    reactorJob jobs[REACTOR_JOB_CAPACITY];
+    int jobs_head;
+    int jobs_count;
+    pthread_mutex_t jobs_mutex;
+    pthread_cond_t jobs_notEmpty;
+    pthread_cond_t jobs_notFull;
+
+    client* removed; // Clients whose reference the epoll loop drops after its current batch
+    pthread_mutex_t removed_mutex;
+
+    reactor_handler on_readable; // Runs on a worker, must call reactor_rearm() unless the client is gone
+    reactor_handler on_writable; // Runs on a worker, must call reactor_rearmQueue() or reactor_waitWritable() unless the client is gone
+
+    volatile sig_atomic_t* running;
+    int stopping;
+} reactor;
+
+extern reactor* server_reactor;
+
+reactor* reactor_init(volatile sig_atomic_t* running, reactor_handler on_readable, reactor_handler on_writable, timerWheel* wheel);
+
+int reactor_add(reactor* r, client* cli); // Takes its own reference, dropped after reactor_remove()
+
+int reactor_rearm(reactor* r, client* cli);
+
+int reactor_remove(reactor* r, client* cli);
+
+int reactor_rearmQueue(reactor* r, client* cli);
+
+int reactor_waitWritable(reactor* r, client* cli); // Instead of reactor_rearmQueue(), JOB_WRITE comes back once the socket drains
+
+void reactor_destroy(reactor* r);
+
+#endif
+
+#endif // REACTOR_H_INCLUDED
@@ -9,8 +9,12 @@
 #include "cJSON_Utils.h"
 #include "protocolhandler.h"
 #include "websocket.h"
-
-Queue* output_queue;
+#include "reactor.h"
+#include "pool.h"
+#include "wire.h"
+#include "timerwheel.h"
+#include <stddef.h>
+#include <fcntl.h>
 
 client* selectedClient = NULL;
 
@@ -20,11 +24,6 @@ volatile sig_atomic_t server_running = 1;
 volatile sig_atomic_t web_running = 1;
 
 
-static struct lws_protocols protocols[] = {
-    {"", callback, 0, 0, 0,}, // Added id = 0
-    {NULL, NULL, 0, 0, 0}                // Added id = 0
-};
-
 /*
  *
  * WEB THREAD:
@@ -34,12 +33,12 @@ static struct lws_protocols protocols[] = {
  * UPON RECEIVAL:
  *      PARSES RECEIVED MESSAGE, DELIMITER = ':'
  *      EXCTRACTS ADDRESSED CLIENT & COMMAND (cli1:whoami)
- *      SENDS EXTRACTED COMMAND THROUGH CLIENT'S SOCKET AFTER GRABBING THE CLIENT FROM HASH
+ *      SENDS EXTRACTED COMMAND THROUGH CLIENT'S SOCKET AFTER GRABBING THE CLIENT BY ITS HANDLE
  *
  * LOOPS:
- *      CHECKS FOR WEBSOCKET CALLBACKS
- *      POPS QUEUE, GRABS OUTPUT THAT WAS PUSHED BY A CLIENT THREAD
- *      SENDS THE OUTPUT TO WEB SERVER THROUGH WEBSOCKET
+ *      SLEEPS IN lws_service() UNTIL A WEBSOCKET CALLBACK OR lws_cancel_service()
+ *      ON LWS_CALLBACK_EVENT_WAIT_CANCELLED, ASKS FOR LWS_CALLBACK_CLIENT_WRITEABLE IF THE REACTOR WORKERS PUSHED OUTPUT
+ *      ON LWS_CALLBACK_CLIENT_WRITEABLE, SENDS THE OUTBOUND RING TO WEB SERVER, BATCHED PER sendmsg(), UNTIL THE SOCKET IS FULL
  *
  */
 
@@ -89,6 +88,12 @@ int accept_connection(int serverListen_socket, struct sockaddr_in* connectedClie
         fprintf(stderr, "[ERROR] accept() failed %d: %s\n", ERRNO, strerror(ERRNO));
         return -1;
     }
+    int flags = fcntl(serverCurrCon_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(serverCurrCon_socket, F_SETFL, flags | O_NONBLOCK) == -1) { // Workers must never block on an agent
+        fprintf(stderr, "[ERROR] fcntl(O_NONBLOCK) failed %d: %s\n", ERRNO, strerror(ERRNO));
+        close(serverCurrCon_socket);
+        return -1;
+    }
 
     return serverCurrCon_socket;
 }
@@ -112,226 +117,304 @@ void signal_handler(int sig) {
 
 /*
  *
- * CLIENT THREAD:
- * RECEIVES COMMAND OUTPUT FROM THE CONNECTED CLIENT
- * PUSHES OUTPUT TO THE QUEUE
- * REMOVES CLIENT FROM CLIENTHASH UPON DISCONNECTION
+ * CLIENT HANDLERS (RUN ON REACTOR WORKERS):
+ * handle_client_commands : FLUSHES THE CLIENT'S COMMAND QUEUE THROUGH ITS SOCKET, PARKS A PARTLY SENT FRAME IN cli->unsent WHEN IT IS FULL
+ * handle_client_output   : REASSEMBLES WIRE FRAMES FROM THE CONNECTED CLIENT & PUSHES EACH OUTPUT CHUNK TO THE OUTPUT QUEUE
+ *                          REMOVES CLIENT FROM CLIENTSLOTS UPON DISCONNECTION
+ *
+ * EACH JOB HOLDS A REFERENCE ON cli, SO IT STAYS VALID EVEN IF ANOTHER WORKER DISCONNECTS IT MEANWHILE
+ * THE SOCKET IS ONLY shutdown() ON DISCONNECTION, THE LAST REFERENCE CLOSES IT (NO fd REUSE UNDER A WORKER)
  *
  */
-#ifdef _WIN32
-DWORD WINAPI handle_client(LPVOID lpParam) {
-    int client_socket = ((client*)lpParam)->socket_desc;
-    #else
-    void* handle_client(void* arg) {
-        client* thread_client = (client*)arg;
-        int client_socket = thread_client->socket_desc;
-        #endif
-        while (server_running) {
-
-            char command[1024];
-            char* c = queue_pop(thread_client->command_queue);
-            if (!c)
-                continue; // No command was popped, loop again
-
-            size_t command_size = strlen(c);
-            snprintf(command, command_size + 1, "%s", c);
-
-            send(thread_client->socket_desc, command, command_size, 0);
-
-            char output_recvBuffer[BUFFER_SIZE]; // CMD output
-
-            int bytes_received = recv(client_socket, output_recvBuffer, BUFFER_SIZE - 1, 0); // Can block the next queue_pop iteration for a while, needs fix if so
-
-            if (bytes_received > 0) {
-
-                output_recvBuffer[bytes_received] = '\0';
-                printf("THREAD [ %d ] : Received from [ %s : %s ]: \n %s \n", (int) ((client*)arg)->thread, ((client*)arg)->id, ((client*)arg)->ip, output_recvBuffer);
-
-
-                PROTOCOL_MESSAGE* msg = protocol_create_msg(RESPONSE, CMD_OUTPUT, REACTFRONT, CSERVER,
-                                                            thread_client->id, output_recvBuffer,
-                                                            strlen(thread_client->id), strlen(output_recvBuffer));
-
-                char* jsonMsg = protocol_create_jsonMsg(msg); // Create JSON string
-                queueNode* node = queue_createNode(jsonMsg);
-                if (node)
-                    queue_push(output_queue, node); // Push RESPONSE : CMD_OUTPUT jsonString to output queue
-                else {
-                    fprintf(stderr, "[ERROR] Unable to push queueNode holding your output to queue. queueNode == NULL\n");
-                    if (protocol_send_error(websocket_global_wss->wsi, "[ERROR] Unable to push queueNode holding your output to queue. queueNode == NULL") != 0)
-                        fprintf(stderr, "[ERROR] [server.c/handle_client] Failed to send error message\n");
-                }
-                free(jsonMsg);
-            } else if (bytes_received == 0) {
-                printf("Client disconnected.\n");
-                hash_remove(clientHash, thread_client->id);
-                websocket_send_connectionsList(websocket_global_wss, clientHash);
-                break;
-            } else {
-                fprintf(stderr, "[ERROR] recv() from client failed: %d\n", ERRNO);
-            }
+// 1: cli->unsent went out & was freed, 0: the socket is full, -1: send() failed
+static int send_unsent(client* cli) {
+    while (cli->unsent_off < cli->unsent_len) {
+        ssize_t sent = send(cli->socket_desc, cli->unsent + cli->unsent_off, cli->unsent_len - cli->unsent_off, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (ERRNO == EINTR) continue;
+            return ERRNO == EAGAIN || ERRNO == EWOULDBLOCK ? 0 : -1;
         }
-
-        close(client_socket);
-        #ifdef _WIN32
-        return 0;
-        #else
-        pthread_exit(NULL);
-        return NULL;
-        #endif
+        cli->unsent_off += sent;
     }
+    pool_bufFree(cli->unsent);
+    cli->unsent = NULL;
+    return 1;
+}
 
-    int main() {
-        signal(SIGINT, signal_handler);
-        signal(SIGTERM, signal_handler);
-
-        init_mutexes();
-        if (pthread_mutex_init(&selected_client_mutex, NULL) != 0) {
-            perror("[ERROR] selected_client_mutex init failed\n");
-            return 1;
+void handle_client_commands(client* cli) {
+    if (atomic_load(&cli->closed)) return;
+    queue_ackEvent(cli->command_queue); // Before draining, a push after this re-signals event_fd
+    for (;;) {
+        if (!cli->unsent) { // Else resuming after EPOLLOUT
+            cli->unsent = queue_pop(cli->command_queue, &cli->unsent_len); // Each entry is a complete wire frame
+            if (!cli->unsent) break;
+            cli->unsent_off = 0;
         }
-
-        #ifdef _WIN32
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            perror("[ERROR] WSAStartup failed");
-            return 1;
+        int ret = send_unsent(cli);
+        if (ret == 0) { // The agent is not reading, this worker goes back to the pool
+            reactor_waitWritable(server_reactor, cli);
+            return;
         }
-        #endif
-
-        int serverListen_socket;
-        struct sockaddr_in local_address;
+        if (ret == -1) {
+            fprintf(stderr, "[ERROR] [server.c/handle_client_commands] send() to " CLIENT_ID_FMT " failed %d: %s\n", cli->handle, ERRNO, strerror(ERRNO));
+            pool_bufFree(cli->unsent);
+            cli->unsent = NULL;
+        }
+    }
+    reactor_rearmQueue(server_reactor, cli);
+}
 
-        serverListen_socket = createSocket();
-        if (serverListen_socket == -1) return 1;
-        sockaddr_in_init(&local_address);
-        if (bind_socket(serverListen_socket, &local_address) == -1) return 1;
-        if (listen_socket(serverListen_socket) == -1) return 1;
+void disconnect_client(client* cli) {
+    if (atomic_exchange(&cli->closed, 1)) return; // Read & write jobs may both see the disconnection
+    printf("Client " CLIENT_ID_FMT " disconnected.\n", cli->handle);
+    if (wheel_cancel(server_wheel, &cli->live_timer))
+        client_release(cli); // Otherwise the timer is firing, its callback drops the reference
+    protocol_drop_commands(cli);
+    reactor_remove(server_reactor, cli);
+    shutdown(cli->socket_desc, SHUT_RDWR);
+    slot_remove(clientSlots, cli->handle);
+    websocket_schedule_connectionsDelta(websocket_global_wss);
+}
 
-        printf("Listening on port %d...\n", SERVER_PORT);
+static void handle_client_frame(client* cli, wireFrame* frame) {
+    enum PROTOCOl_CONTENT_TYPE content;
+    switch (frame->type) {
+        case WIRE_OUTPUT_START: content = CMD_OUTPUT_START; break;
+        case WIRE_OUTPUT: content = CMD_OUTPUT; break;
+        case WIRE_OUTPUT_END:
+            content = CMD_OUTPUT_END;
+            protocol_complete_command(cli, frame->request_id);
+            break;
+        case WIRE_OUTPUT_STDERR: content = CMD_ERROR_OUTPUT; break;
+        case WIRE_BEACON: return; // Liveness only, the recv() already refreshed last_seen
+        default:
+            fprintf(stderr, "[ERROR] [server.c/handle_client_frame] Unexpected frame type %u from " CLIENT_ID_FMT "\n", frame->type, cli->handle);
+            return;
+    }
+    printf("Received from [ " CLIENT_ID_FMT " : %s ] (request %u, type %u, %u bytes)\n", cli->handle, cli->ip, frame->request_id, frame->type, frame->len); // Never the payload, verbose output is streamed to keep it off this path
+
+    // Every chunk is forwarded as it arrives. Borrows the frame straight out of the reassembly buffer, nothing is copied before it is escaped into the JSON
+    PROTOCOL_MESSAGE msg = {
+        .msg_type = RESPONSE, .content_type = content,
+        .destination = REACTFRONT, .source = CSERVER,
+        .payload = frame->payload, .payload_size = frame->len,
+        .specifiedClient = cli->handle, .request_id = frame->request_id, // Outputs may come back in any order
+    };
+    size_t jsonLen;
+    char* jsonMsg = protocol_create_jsonMsg(&msg, &jsonLen); // Escapes the output straight into a buffer the web thread frames in place
+    if (!jsonMsg) {
+        fprintf(stderr, "[ERROR] [server.c/handle_client_frame] Unable to build the RESPONSE for " CLIENT_ID_FMT "\n", cli->handle);
+        if (protocol_send_error(websocket_global_wss, "[ERROR] Unable to build the RESPONSE holding your output") != 0)
+            fprintf(stderr, "[ERROR] [server.c/handle_client_frame] Failed to send error message\n");
+        return;
+    }
+    // A full ring holds this worker (& so this agent's recv()) for up to WS_PUSH_WAIT_MS, the frontend is not keeping up
+    if (websocket_push_output(websocket_global_wss, jsonMsg, jsonLen, WS_PUSH_WAIT_MS) != 0) {
+        fprintf(stderr, "[ERROR] [server.c/handle_client_frame] Outbound ring still full after %d ms, dropped %u bytes of request %u from " CLIENT_ID_FMT "\n",
+                WS_PUSH_WAIT_MS, frame->len, frame->request_id, cli->handle);
+        pool_bufFree(jsonMsg);
+    }
+}
 
-        // Create the output queue
-        output_queue = malloc(sizeof(Queue));
-        if (!output_queue) {
-            fprintf(stderr, "[ERROR] Failed to allocate output_queue\n");
-            destroy_mutexes();
-            close(serverListen_socket);
-            #ifdef _WIN32
-            WSACleanup();
-            #endif
-            return 1;
-        }
-        queue_init(output_queue);
-
-        // Create client storing hash
-        clientHash = malloc(sizeof(hashMap));
-        if (!clientHash) {
-            fprintf(stderr, "[ERROR] Failed to allocate memory for client hash\n");
-            queue_destroy(output_queue);
-            free(output_queue);
-            destroy_mutexes();
-            close(serverListen_socket);
-            #ifdef _WIN32
-            WSACleanup();
-            #endif
-            return 1;
-        }
-        clientHash = hash_init(HASH_SIZE); // Initialize a hash for 100 clients
-
-        websocket_global_wss = websocket_init(&web_running, output_queue, clientHash);
-        if (!websocket_global_wss) {
-            fprintf(stderr, "[ERROR] [server.c/main] Failed to initialize WebSocket service struct\n");
-            queue_destroy(output_queue);
-            free(output_queue);
-            destroy_mutexes();
-            close(serverListen_socket);
-            #ifdef _WIN32
-            WSACleanup();
-            #endif
-            return 1;
-        }
+void handle_client_output(client* cli) {
+    if (atomic_load(&cli->closed)) return;
 
-        // Create web thread
-        pthread_t web_thread_id;
-        if (pthread_create(&web_thread_id, NULL, websocket_thread, websocket_global_wss) != 0) {
-            fprintf(stderr, "[ERROR] Failed to create web_thread\n");
-            queue_destroy(output_queue);
-            free(output_queue);
-            destroy_mutexes();
-            close(serverListen_socket);
-            #ifdef _WIN32
-            WSACleanup();
-            #endif
-            websocket_destroy(websocket_global_wss);
-            return 1;
+    size_t avail;
+    char* dst = wire_bufferReserve(&cli->inbox, wire_bufferWant(&cli->inbox), &avail); // recv() straight into the reassembly buffer
+    if (!dst) {
+        fprintf(stderr, "[ERROR] [server.c/handle_client_output] Failed to grow the receive buffer of " CLIENT_ID_FMT "\n", cli->handle);
+        disconnect_client(cli);
+        return;
+    }
+    int bytes_received = recv(cli->socket_desc, dst, avail, 0);
+
+    if (bytes_received > 0) {
+        atomic_store_explicit(&cli->last_seen, wheel_now(), memory_order_relaxed); // Any traffic counts, the silence timer checks it lazily
+        wire_bufferCommit(&cli->inbox, bytes_received);
+        wireFrame frame;
+        int ret;
+        while ((ret = wire_nextFrame(&cli->inbox, &frame)) == 1) // Zero, one or several complete frames per recv()
+            handle_client_frame(cli, &frame);
+        if (ret == -1) {
+            fprintf(stderr, "[ERROR] [server.c/handle_client_output] Corrupt frame from " CLIENT_ID_FMT ", dropping it\n", cli->handle);
+            disconnect_client(cli);
+            return;
         }
-        pthread_detach(web_thread_id);
-
-        int currClient_ID = 0;
+    } else if (bytes_received == 0 || (ERRNO != EINTR && ERRNO != EAGAIN)) {
+        if (bytes_received < 0)
+            fprintf(stderr, "[ERROR] recv() from client failed: %d\n", ERRNO);
+        disconnect_client(cli);
+        return;
+    }
 
-        while (server_running) {
-            struct sockaddr_in currConn_address;
-            socklen_t conAddr_size = sizeof(currConn_address);
-            printf("Server waiting for connection...\n");
+    reactor_rearm(server_reactor, cli);
+}
 
-            int currCon_socket = accept_connection(serverListen_socket, &currConn_address, &conAddr_size);
+/*
+ *
+ * AGENT LIVENESS:
+ * EVERY REGISTERED CLIENT HAS ITS live_timer ON server_wheel, NOT MOVED BY TRAFFIC (A recv() ONLY STAMPS last_seen)
+ * WHEN IT FIRES, THE TIMER IS PUSHED BACK TO last_seen + WIRE_SILENCE_TIMEOUT, OR THE AGENT IS EVICTED (LIST_UPDATE)
+ *
+ */
+static void on_agent_silent(timerNode* node, int expired) {
+    client* cli = (client*)((char*)node - offsetof(client, live_timer));
+    if (expired && !atomic_load(&cli->closed)) {
+        uint64_t idle = wheel_now() - atomic_load_explicit(&cli->last_seen, memory_order_relaxed);
+        if (idle < WIRE_SILENCE_TIMEOUT) {
+            if (wheel_schedule(server_wheel, node, WIRE_SILENCE_TIMEOUT - idle) == 0)
+                return; // Keeps its reference
+        } else {
+            printf("Evicting " CLIENT_ID_FMT ": silent for %llu ms\n", cli->handle, (unsigned long long)idle);
+            disconnect_client(cli);
+        }
+    }
+    client_release(cli);
+}
 
-            char* clientIP = malloc(INET_ADDRSTRLEN);
-            if (clientIP ? getClient_IP(clientIP, &currConn_address, currCon_socket) == -1 : 1) { // if clientIP == NULL, close connection, aswell as if getClient_IP fails
-                printf("[ERROR] Connection closed due to getClient_IP failure\n");
-                close(currCon_socket);
-                free(clientIP);
-                #ifdef _WIN32
-                WSACleanup();
-                #endif
-                continue;
-            }
+int main() {
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
 
-            client* newClient = createClient(currCon_socket, clientIP, &currClient_ID);
-            hash_put(clientHash, newClient);
-            websocket_send_connectionsList(websocket_global_wss, clientHash);
+    // cJSON trees & printed strings come from the size-class pools too, queued buffers are always pool_bufFree'd
+    cJSON_Hooks pool_hooks = { .malloc_fn = pool_bufAlloc, .free_fn = pool_bufFree };
+    cJSON_InitHooks(&pool_hooks);
 
+    if (pthread_mutex_init(&selected_client_mutex, NULL) != 0) {
+        perror("[ERROR] selected_client_mutex init failed\n");
+        return 1;
+    }
 
-            // Create thread
-            #ifdef _WIN32
-            HANDLE thread_id;
-            newClient->thread = thread_id;
+    #ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        perror("[ERROR] WSAStartup failed");
+        return 1;
+    }
+    #endif
 
-            CreateThread(NULL, 0, handle_client, (void*)&serverCurrCon_socket, 0, &thread_id);
-            CloseHandle(thread_id);
+    int serverListen_socket;
+    struct sockaddr_in local_address;
 
-            #else
-            pthread_t thread_id;
+    serverListen_socket = createSocket();
+    if (serverListen_socket == -1) return 1;
+    sockaddr_in_init(&local_address);
+    if (bind_socket(serverListen_socket, &local_address) == -1) return 1;
+    if (listen_socket(serverListen_socket) == -1) return 1;
 
-            if (pthread_create(&thread_id, NULL, handle_client, (void*) newClient) != 0) {
-                free(newClient->ip);
-                free(newClient->id);
-                free(newClient);
-            }
+    printf("Listening on port %d...\n", SERVER_PORT);
 
-            newClient->thread = thread_id;
+    // Create the client slot table, chunks are added as clients connect
+    clientSlots = slot_init();
+    if (!clientSlots) {
+        fprintf(stderr, "[ERROR] Failed to allocate memory for client slot table\n");
+        close(serverListen_socket);
+        #ifdef _WIN32
+        WSACleanup();
+        #endif
+        return 1;
+    }
 
-            pthread_detach(thread_id);
-            #endif
-            printf("Connected to: %s:%d ||| Thread ID: %ld ||| Client ID: %s\n", clientIP, ntohs(currConn_address.sin_port), (long)thread_id, newClient->id);
-        }
+    websocket_global_wss = websocket_init(&web_running, clientSlots); // Owns the outbound ring every RESPONSE goes through
+    if (!websocket_global_wss) {
+        fprintf(stderr, "[ERROR] [server.c/main] Failed to initialize WebSocket service struct\n");
+        close(serverListen_socket);
+        #ifdef _WIN32
+        WSACleanup();
+        #endif
+        return 1;
+    }
 
-        web_running = 0;
-        pthread_join(web_thread_id, NULL);
-
-        printf("Destroying queue...\n");
-        queue_destroy(output_queue);
-        printf("Waiting for threads to terminate before destroying client hashmap...\n");
-        sleep(5);
-        hash_destroy(clientHash);
-        free(clientHash);
-        free(output_queue);
-        destroy_mutexes();
+    // Create web thread
+    pthread_t web_thread_id;
+    if (pthread_create(&web_thread_id, NULL, websocket_thread, websocket_global_wss) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create web_thread\n");
         close(serverListen_socket);
         #ifdef _WIN32
         WSACleanup();
         #endif
         websocket_destroy(websocket_global_wss);
-        printf("Server listen socket closed. Server terminated.\n");
-        return 0;
+        return 1;
     }
+    pthread_detach(web_thread_id);
+
+    // Command deadlines & agent liveness, ticked by the reactor's epoll loop
+    server_wheel = wheel_init();
+
+    // Create the reactor: one epoll loop + a fixed pool of workers for every client socket
+    server_reactor = server_wheel ? reactor_init(&server_running, handle_client_output, handle_client_commands, server_wheel) : NULL;
+    if (!server_reactor) {
+        fprintf(stderr, "[ERROR] [server.c/main] Failed to initialize reactor\n");
+        wheel_destroy(server_wheel);
+        web_running = 0;
+        close(serverListen_socket);
+        websocket_destroy(websocket_global_wss);
+        return 1;
+    }
+
+    while (server_running) {
+        struct sockaddr_in currConn_address;
+        socklen_t conAddr_size = sizeof(currConn_address);
+        printf("Server waiting for connection...\n");
+
+        int currCon_socket = accept_connection(serverListen_socket, &currConn_address, &conAddr_size);
+        if (currCon_socket == -1)
+            continue;
+
+        char* clientIP = pool_bufAlloc(INET_ADDRSTRLEN);
+        if (clientIP ? getClient_IP(clientIP, &currConn_address, currCon_socket) == -1 : 1) { // if clientIP == NULL, close connection, aswell as if getClient_IP fails
+            printf("[ERROR] Connection closed due to getClient_IP failure\n");
+            close(currCon_socket);
+            pool_bufFree(clientIP);
+            #ifdef _WIN32
+            WSACleanup();
+            #endif
+            continue;
+        }
+
+        client* newClient = createClient(currCon_socket, clientIP);
+        if (!newClient)
+            continue;
+        if (!slot_put(clientSlots, newClient)) {
+            client_release(newClient); // Only reference, closes currCon_socket
+            continue;
+        }
+        websocket_schedule_connectionsDelta(websocket_global_wss);
+
+        // Armed before a worker can see the client, disconnect_client() cancels it
+        wheel_nodeInit(&newClient->live_timer, on_agent_silent);
+        client_acquire(newClient); // Held by live_timer
+        if (wheel_schedule(server_wheel, &newClient->live_timer, WIRE_SILENCE_TIMEOUT) != 0)
+            client_release(newClient);
+
+        // Hand the socket over to the reactor, no thread per client
+        if (reactor_add(server_reactor, newClient) != 0) {
+            atomic_store(&newClient->closed, 1);
+            if (wheel_cancel(server_wheel, &newClient->live_timer))
+                client_release(newClient);
+            slot_remove(clientSlots, newClient->handle);
+            client_release(newClient); // Last reference, closes currCon_socket
+            websocket_schedule_connectionsDelta(websocket_global_wss);
+            continue;
+        }
+        printf("Connected to: %s:%d ||| Client ID: " CLIENT_ID_FMT "\n", clientIP, ntohs(currConn_address.sin_port), newClient->handle);
+        client_release(newClient); // clientSlots & the reactor hold their own references now
+    }
+
+    web_running = 0;
+    pthread_join(web_thread_id, NULL);
+
+    printf("Waiting for reactor workers to terminate before destroying client slots...\n");
+    reactor_destroy(server_reactor);
+    wheel_destroy(server_wheel); // Drops the references held by live timers & pending commands
+    slot_destroy(clientSlots);
+    free(clientSlots);
+    close(serverListen_socket);
+    #ifdef _WIN32
+    WSACleanup();
+    #endif
+    websocket_destroy(websocket_global_wss);
+    pool_printStats(stdout);
+    printf("Server listen socket closed. Server terminated.\n");
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include "skiplist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static skipNode* skip_createNode(int level, const char* key, void* value) {
+    skipNode* node = malloc(sizeof(skipNode) + level * sizeof(skipLink));
+    if (!node) return NULL;
+    node->key = NULL;
+    if (key) {
+        size_t len = strlen(key);
+        node->key = malloc(len + 1);
+        if (!node->key) {
+            free(node);
+            return NULL;
+        }
+        memcpy(node->key, key, len + 1);
+    }
+    node->value = value;
+    node->level = level;
+    for (int i = 0; i < level; i++) {
+        node->links[i].next = NULL;
+        node->links[i].width = 0;
+    }
+    return node;
+}
+
+static int skip_randomLevel(skiplist* list) {
+    int level = 1;
+    uint32_t x = list->seed;
+    for (;;) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if ((x & 3) != 0 || level == SKIP_MAX_LEVEL) break; // 1 in 4 goes one level up
+        level++;
+    }
+    list->seed = x;
+    return level;
+}
+
+skiplist* skip_init() {
+    skiplist* list = malloc(sizeof(skiplist));
+    if (!list) {
+        fprintf(stderr, "[ERROR] [skiplist/skip_init] Failed to allocate memory for skiplist\n");
+        return NULL;
+    }
+    list->head = skip_createNode(SKIP_MAX_LEVEL, NULL, NULL);
+    if (!list->head) {
+        fprintf(stderr, "[ERROR] [skiplist/skip_init] Failed to allocate memory for the head node\n");
+        free(list);
+        return NULL;
+    }
+    list->level = 1;
+    list->count = 0;
+    list->seed = 0x9E3779B9u;
+    return list;
+}
+
+// Fills update[] with the last node before key on every level, rank[] with their ranks
+static skipNode* skip_descend(skiplist* list, const char* key, skipNode** update, size_t* rank) {
+    skipNode* x = list->head;
+    for (int i = list->level - 1; i >= 0; i--) {
+        rank[i] = i == list->level - 1 ? 0 : rank[i + 1];
+        while (x->links[i].next && strcmp(x->links[i].next->key, key) < 0) {
+            rank[i] += x->links[i].width;
+            x = x->links[i].next;
+        }
+        update[i] = x;
+    }
+    return x->links[0].next;
+}
+
+int skip_insert(skiplist* list, const char* key, void* value) {
+    skipNode* update[SKIP_MAX_LEVEL];
+    size_t rank[SKIP_MAX_LEVEL];
+    skipNode* found = skip_descend(list, key, update, rank);
+    if (found && strcmp(found->key, key) == 0) return -1;
+
+    int level = skip_randomLevel(list);
+    skipNode* node = skip_createNode(level, key, value);
+    if (!node) {
+        fprintf(stderr, "[ERROR] [skiplist/skip_insert] Failed to allocate memory for node\n");
+        return -1;
+    }
+    if (level > list->level) {
+        for (int i = list->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = list->head;
+            update[i]->links[i].width = list->count;
+        }
+        list->level = level;
+    }
+    for (int i = 0; i < level; i++) {
+        node->links[i].next = update[i]->links[i].next;
+        update[i]->links[i].next = node;
+        node->links[i].width = update[i]->links[i].width - (rank[0] - rank[i]);
+        update[i]->links[i].width = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = level; i < list->level; i++)
+        update[i]->links[i].width++; // Jumps over the new node
+    list->count++;
+    return 0;
+}
+
+void* skip_remove(skiplist* list, const char* key) {
+    skipNode* update[SKIP_MAX_LEVEL];
+    size_t rank[SKIP_MAX_LEVEL];
+    skipNode* node = skip_descend(list, key, update, rank);
+    if (!node || strcmp(node->key, key) != 0) return NULL;
+
+    for (int i = 0; i < list->level; i++) {
+        if (update[i]->links[i].next == node) {
+            update[i]->links[i].width += node->links[i].width - 1;
+            update[i]->links[i].next = node->links[i].next;
+        } else {
+            update[i]->links[i].width--;
+        }
+    }
+    while (list->level > 1 && list->head->links[list->level - 1].next == NULL)
+        list->level--;
+    list->count--;
+
+    void* value = node->value;
+    free(node->key);
+    free(node);
+    return value;
+}
+
+void* skip_find(skiplist* list, const char* key) {
+    size_t rank;
+    skipNode* node = skip_lowerBound(list, key, &rank);
+    return node && strcmp(node->key, key) == 0 ? node->value : NULL;
+}
+
+skipNode* skip_lowerBound(skiplist* list, const char* key, size_t* rank) {
+    skipNode* x = list->head;
+    size_t traversed = 0;
+    for (int i = list->level - 1; i >= 0; i--) {
+        while (x->links[i].next && strcmp(x->links[i].next->key, key) < 0) {
+            traversed += x->links[i].width;
+            x = x->links[i].next;
+        }
+    }
+    *rank = traversed; // Nodes before the bound
+    return x->links[0].next;
+}
+
+skipNode* skip_at(skiplist* list, size_t rank) {
+    if (rank >= list->count) return NULL;
+    size_t target = rank + 1; // Head is rank 0, the first node rank 1
+    skipNode* x = list->head;
+    size_t traversed = 0;
+    for (int i = list->level - 1; i >= 0; i--) {
+        while (x->links[i].next && traversed + x->links[i].width <= target) {
+            traversed += x->links[i].width;
+            x = x->links[i].next;
+        }
+        if (traversed == target) return x;
+    }
+    return NULL;
+}
+
+void skip_clear(skiplist* list, void (*free_value)(void* value)) {
+    skipNode* node = list->head->links[0].next;
+    while (node) {
+        skipNode* next = node->links[0].next;
+        if (free_value) free_value(node->value);
+        free(node->key);
+        free(node);
+        node = next;
+    }
+    for (int i = 0; i < SKIP_MAX_LEVEL; i++) {
+        list->head->links[i].next = NULL;
+        list->head->links[i].width = 0;
+    }
+    list->level = 1;
+    list->count = 0;
+}
+
+void skip_destroy(skiplist* list, void (*free_value)(void* value)) {
+    if (!list) return;
+    skip_clear(list, free_value);
+    free(list->head);
+    free(list);
+}
@@ -0,0 +1,69 @@
+#ifndef SKIPLIST_H_INCLUDED
+#define SKIPLIST_H_INCLUDED
+
+
+#ifndef SKIPLIST // Include guard
+#define SKIPLIST
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SKIP_MAX_LEVEL 12 // p = 1/4, balanced up to 4^12 = 16M keys
+
+/*
+ *
+ * INDEXABLE SKIP LIST:
+ * STRING KEYS IN strcmp() ORDER, UNIQUE, EACH WITH AN OPAQUE value
+ *
+ *      EVERY LINK ALSO STORES ITS width (LEVEL 0 STEPS IT JUMPS), SO A NODE'S RANK IS SUMMED ON THE WAY DOWN
+ *      FIND / INSERT / REMOVE / LOWER BOUND / RANK -> NODE ARE ALL O(log n), WALKING ON IS O(1) PER NODE
+ *      A PAGE (PREFIX RANGE + OFFSET + LIMIT) THEREFORE COSTS O(log n + page), NOT O(n)
+ *
+ * NOT THREAD-SAFE, THE OWNER SERIALIZES ACCESS
+ *
+ */
+
+typedef struct skipNode skipNode;
+
+typedef struct skipLink {
+    skipNode* next;
+    size_t width; // Rank of next - rank of this node, counted as if NULL sat right after the last node
+} skipLink;
+
+struct skipNode {
+    char* key; // Owned copy
+    void* value;
+    int level;
+    skipLink links[]; // level entries
+};
+
+typedef struct skiplist {
+    skipNode* head; // Sentinel, rank 0, SKIP_MAX_LEVEL links
+    int level;
+    size_t count;
+    uint32_t seed; // xorshift state for node levels
+} skiplist;
+
+skiplist* skip_init();
+
+int skip_insert(skiplist* list, const char* key, void* value); // -1 if the key exists or on allocation failure
+
+void* skip_remove(skiplist* list, const char* key); // Returns the value, NULL if the key is absent
+
+void* skip_find(skiplist* list, const char* key);
+
+skipNode* skip_lowerBound(skiplist* list, const char* key, size_t* rank); // First key >= key (NULL if none), rank = its 0-based position
+
+skipNode* skip_at(skiplist* list, size_t rank); // 0-based, NULL past the end
+
+static inline skipNode* skip_next(skipNode* node) {
+    return node->links[0].next;
+}
+
+void skip_clear(skiplist* list, void (*free_value)(void* value)); // free_value may be NULL
+
+void skip_destroy(skiplist* list, void (*free_value)(void* value));
+
+#endif
+
+#endif // SKIPLIST_H_INCLUDED
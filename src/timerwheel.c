@@ -0,0 +1,160 @@
+#include "timerwheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+timerWheel* server_wheel = NULL;
+
+uint64_t wheel_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t wheel_tickNow(timerWheel* w) {
+    return (wheel_now() - w->start_ms) / WHEEL_TICK_MS;
+}
+
+static void list_init(timerNode* head) {
+    head->next = head->prev = head;
+}
+
+static void list_unlink(timerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+// base: first tick not processed yet, the node lands in the lowest level whose range covers expires - base
+static void wheel_link(timerWheel* w, timerNode* node, uint64_t base) {
+    if (node->expires < base) node->expires = base;
+    uint64_t delta = node->expires - base;
+    if (delta >= WHEEL_MAX_TICKS) {
+        delta = WHEEL_MAX_TICKS - 1;
+        node->expires = base + delta;
+    }
+    int level = 0;
+    while (delta >= ((uint64_t)1 << (WHEEL_LEVEL_BITS * (level + 1)))) level++;
+    timerNode* head = &w->slots[level][(node->expires >> (WHEEL_LEVEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+// Moves every node of the slot onto a singly linked chain (next), prev = NULL marks them as no longer pending
+static timerNode* wheel_takeSlot(timerWheel* w, timerNode* head, timerNode* chain) {
+    while (head->next != head) {
+        timerNode* node = head->next;
+        list_unlink(node);
+        node->next = chain;
+        chain = node;
+        w->count--;
+    }
+    return chain;
+}
+
+static void wheel_runChain(timerNode* chain, int expired) {
+    while (chain != NULL) {
+        timerNode* node = chain;
+        chain = node->next; // fn may free or reschedule node
+        node->next = NULL;
+        node->fn(node, expired);
+    }
+}
+
+timerWheel* wheel_init() {
+    timerWheel* w = malloc(sizeof(timerWheel));
+    if (!w) {
+        fprintf(stderr, "[ERROR] [timerwheel/wheel_init] Failed to allocate memory for timer wheel\n");
+        return NULL;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+            list_init(&w->slots[level][slot]);
+    w->now_tick = 0;
+    w->start_ms = wheel_now();
+    w->count = 0;
+    w->stopping = 0;
+    pthread_mutex_init(&w->mutex, NULL);
+    return w;
+}
+
+void wheel_nodeInit(timerNode* node, wheel_fn fn) {
+    node->next = node->prev = NULL;
+    node->expires = 0;
+    node->fn = fn;
+}
+
+int wheel_schedule(timerWheel* w, timerNode* node, uint64_t delay_ms) {
+    uint64_t expires = wheel_tickNow(w) + (delay_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    pthread_mutex_lock(&w->mutex);
+    if (w->stopping) {
+        pthread_mutex_unlock(&w->mutex);
+        return -1;
+    }
+    if (node->prev != NULL) {
+        list_unlink(node);
+        w->count--;
+    }
+    node->expires = expires;
+    wheel_link(w, node, w->now_tick + 1);
+    w->count++;
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+int wheel_cancel(timerWheel* w, timerNode* node) {
+    pthread_mutex_lock(&w->mutex);
+    if (node->prev == NULL) {
+        pthread_mutex_unlock(&w->mutex);
+        return 0;
+    }
+    list_unlink(node);
+    w->count--;
+    pthread_mutex_unlock(&w->mutex);
+    return 1;
+}
+
+void wheel_expire(timerWheel* w) {
+    timerNode* chain = NULL;
+    uint64_t target = wheel_tickNow(w);
+
+    pthread_mutex_lock(&w->mutex);
+    while (w->now_tick < target && w->count > 0) {
+        uint64_t tick = ++w->now_tick;
+        // Level 0 wrapped: pull the slot of the next span down from each level above, stopping at the first that did not wrap
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (tick & (((uint64_t)1 << (WHEEL_LEVEL_BITS * level)) - 1)) break;
+            timerNode* head = &w->slots[level][(tick >> (WHEEL_LEVEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            while (head->next != head) {
+                timerNode* node = head->next;
+                list_unlink(node);
+                wheel_link(w, node, tick);
+            }
+        }
+        chain = wheel_takeSlot(w, &w->slots[0][tick & (WHEEL_SLOTS - 1)], chain);
+    }
+    if (w->count == 0) w->now_tick = target; // Nothing left to cascade, skip the idle ticks
+    pthread_mutex_unlock(&w->mutex);
+
+    wheel_runChain(chain, 1);
+}
+
+void wheel_destroy(timerWheel* w) {
+    if (!w) return;
+
+    timerNode* chain = NULL;
+    pthread_mutex_lock(&w->mutex);
+    w->stopping = 1;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+            chain = wheel_takeSlot(w, &w->slots[level][slot], chain);
+    pthread_mutex_unlock(&w->mutex);
+
+    wheel_runChain(chain, 0);
+    pthread_mutex_destroy(&w->mutex);
+    free(w);
+}
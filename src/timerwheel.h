@@ -0,0 +1,69 @@
+#ifndef TIMERWHEEL_H_INCLUDED
+#define TIMERWHEEL_H_INCLUDED
+
+
+#ifndef TIMERWHEEL // Include guard
+#define TIMERWHEEL
+
+#include "common.h"
+#include <stdint.h>
+
+#define WHEEL_TICK_MS 50 // Resolution, the reactor's timerfd fires once per tick
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_LEVEL_BITS) // Slots per level
+#define WHEEL_LEVELS 4 // 64^4 ticks = ~9.7 days at 50 ms, longer delays are clamped
+#define WHEEL_MAX_TICKS ((uint64_t)1 << (WHEEL_LEVEL_BITS * WHEEL_LEVELS))
+
+/*
+ *
+ * HIERARCHICAL TIMING WHEEL:
+ * LEVEL 0 HAS ONE SLOT PER TICK, EVERY SLOT OF LEVEL N SPANS 64^N TICKS
+ *
+ *      A TIMER GOES INTO THE LOWEST LEVEL WHOSE RANGE COVERS ITS DELAY, INSERT & CANCEL ARE O(1) (INTRUSIVE LIST)
+ *      WHEN LEVEL 0 WRAPS, THE NEXT SLOT OF LEVEL 1 IS CASCADED DOWN (& SO ON UP), EACH TIMER MOVES AT MOST WHEEL_LEVELS - 1 TIMES
+ *      wheel_expire() CATCHES UP ON EVERY TICK ELAPSED SINCE THE LAST CALL, A LATE TIMERFD NEVER DROPS TIMERS
+ *
+ * CALLBACKS RUN WITHOUT THE WHEEL LOCK HELD, THEY MAY wheel_schedule() THEIR OWN NODE AGAIN
+ * A NODE BELONGS TO WHOEVER TAKES IT OUT: wheel_cancel() RETURNING 1, OR ITS CALLBACK OTHERWISE
+ *
+ */
+
+typedef struct timerNode timerNode;
+
+typedef void (*wheel_fn)(timerNode* node, int expired); // expired 0: the wheel is being destroyed, do not reschedule
+
+struct timerNode {
+    timerNode* next;
+    timerNode* prev; // NULL while not scheduled
+    uint64_t expires; // Tick
+    wheel_fn fn;
+};
+
+typedef struct timerWheel {
+    timerNode slots[WHEEL_LEVELS][WHEEL_SLOTS]; // List heads, circular
+    uint64_t now_tick; // Last tick processed
+    uint64_t start_ms; // Monotonic clock at tick 0
+    int count;
+    int stopping;
+    pthread_mutex_t mutex;
+} timerWheel;
+
+extern timerWheel* server_wheel;
+
+uint64_t wheel_now(); // Monotonic milliseconds, for last-seen stamps
+
+timerWheel* wheel_init();
+
+void wheel_nodeInit(timerNode* node, wheel_fn fn);
+
+int wheel_schedule(timerWheel* w, timerNode* node, uint64_t delay_ms); // Reschedules if already pending, -1 once stopping
+
+int wheel_cancel(timerWheel* w, timerNode* node); // 1 if it was pending (caller owns it now), 0 if expiring/expired
+
+void wheel_expire(timerWheel* w); // Runs every timer due by now, called by the reactor on each timerfd tick
+
+void wheel_destroy(timerWheel* w); // Runs every pending timer's fn with expired = 0, then frees the wheel
+
+#endif
+
+#endif // TIMERWHEEL_H_INCLUDED
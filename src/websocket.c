@@ -1,88 +1,541 @@
 #include "websocket.h"
 #include "protocolhandler.h"
+#include "pool.h"
+#include "skiplist.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+websocket_service* websocket_global_wss = NULL;
+
+/*
+ *
+ * CONNECTION LIST (LIST_UPDATE MESSAGES, QUEUED LIKE COMMAND OUTPUTS):
+ * CONNECTION_LIST  : SNAPSHOT  {"version": V, "clients": [{"id", "ip"}, ...]}                ON REQUEST OR RESYNC ONLY
+ * CONNECTION_DELTA : CHANGES   {"from": A, "to": B, "events": [{"op", "version", "id", "ip"}, ...]}   AFTER EVERY CHANGE
+ *
+ *      EVENTS ARE A+1..B OF THE REGISTRY CHANGE LOG, OLDEST FIRST, op IS "added" OR "removed"
+ *      APPLIED AS UPSERT/DELETE BY id THEY ARE IDEMPOTENT, SO A SNAPSHOT MAY ALREADY CONTAIN SOME OF THE NEXT DELTA
+ *      A DELTA WHOSE from IS NOT THE FRONTEND'S LAST VERSION MEANS IT MISSED ONE: IT SENDS REQUEST : CONNECTION_LIST
+ *      THE SERVER SENDS A SNAPSHOT BY ITSELF WHEN THE CHANGE LOG LAPPED list_version
+ *
+ * COST IS O(CHANGES) PER UPDATE, A RECONNECT STORM OF N AGENTS NO LONGER SERIALIZES THE REGISTRY N TIMES
+ *
+ * PAGES (REQUEST : CONNECTION_LIST WITH A "query" OBJECT, ANSWERED AS RESPONSE : CONNECTION_LIST WITH ITS request_id):
+ *      query  : {"offset", "limit", "cursor", "id_prefix", "ip"}, ALL OPTIONAL, "ip" IS A PREFIX TOO ("10.0.0.")
+ *      answer : {"version": V, "total", "offset", "clients": [{"id", "ip"}, ...], "next_cursor"}   next_cursor ONLY IF MORE FOLLOW
+ *      SERVED FROM TWO SKIP LISTS OWNED BY THE WEB THREAD: BY "cliN" & BY "ip cliN", IN strcmp() ORDER
+ *      BEFORE EACH PAGE THEY REPLAY THE CHANGE LOG SINCE index_version (A LAPPED LOG REBUILDS THEM), SO CONNECTS STAY O(1)
+ *      A PREFIX IS ONE CONTIGUOUS RANGE: A PAGE COSTS O(log n + limit), total & offset COME FROM THE RANKS
+ *      WITH BOTH FILTERS THE IP RANGE IS WALKED & id_prefix CHECKED PER ENTRY, total & offset ARE LEFT OUT, PAGE BY cursor
+ *
+ * COALESCING:
+ *      THE FIRST CHANGE OPENS A LIST_UPDATE_WINDOW_MS WINDOW ON server_wheel, THE ONES AFTER IT ONLY LAND IN THE CHANGE LOG
+ *      WHEN THE WINDOW CLOSES, ONE DELTA CARRIES THEM ALL, SO A STORM SENDS ONE MESSAGE PER WINDOW WHATEVER ITS SIZE
+ *      list_armed IS CLEARED BEFORE THE LOG IS READ: A CHANGE RACING THE CLOSE IS IN THIS DELTA OR OPENS THE NEXT WINDOW
+ *      A DELTA THAT COULD NOT BE QUEUED (RING FULL) OPENS THE NEXT WINDOW ITSELF, IT DOES NOT WAIT FOR ANOTHER CHANGE
+ *
+ */
+
+#define LIST_DELTA_BATCH 64 // Change log events copied out per slot_logRead()
+
+static const char* registryOps[] = { "", "added", "removed" }; // Indexed by REGISTRY_EVENT_TYPE
+
+typedef struct connEntry { // Shared by both indexes, owned by index_byId
+    clientHandle handle;
+    char id[CLIENT_ID_MAX];
+    char ip[INET_ADDRSTRLEN];
+} connEntry;
+
+static pool connEntry_pool = POOL_INITIALIZER("connEntry", sizeof(connEntry));
+
+static int push_listUpdate(websocket_service* ws, enum PROTOCOL_MESSAGE_TYPES type, enum PROTOCOl_CONTENT_TYPE content,
+                           uint32_t request_id, cJSON* payloadJson) {
+    char* payload = cJSON_PrintUnformatted(payloadJson);
+    if (!payload) {
+        fprintf(stderr, "[ERROR] [websocket/push_listUpdate] cJSON_PrintUnformatted fail\n");
+        return 1;
+    }
+    PROTOCOL_MESSAGE msg = {
+        .msg_type = type, .content_type = content,
+        .destination = REACTFRONT, .source = CSERVER,
+        .request_id = request_id,
+        .payload = payload, .payload_size = strlen(payload),
+    };
+    size_t jsonLen;
+    char* jsonMsg = protocol_create_jsonMsg(&msg, &jsonLen);
+    cJSON_free(payload);
+    if (!jsonMsg) {
+        fprintf(stderr, "[ERROR] [websocket/push_listUpdate] Failed to build the LIST_UPDATE message\n");
+        return 1;
+    }
+    if (websocket_push_urgent(ws, jsonMsg, jsonLen) != 0) { // Ahead of queued outputs, from the epoll loop or web thread (never waits)
+        fprintf(stderr, "[ERROR] [websocket/push_listUpdate] websocket_push_urgent fail\n");
+        pool_bufFree(jsonMsg);
+        return 1;
+    }
+    return 0;
+}
 
-int websocket_send_connectionsList(websocket_service* ws, hashMap* hash) {
-    cJSON* clients = cJSON_CreateArray();
+// Runs on the reactor's epoll loop, or on wheel_destroy() with expired = 0
+static void on_list_window(timerNode* node, int expired) {
+    websocket_service* ws = (websocket_service*)((char*)node - offsetof(websocket_service, list_timer));
+    atomic_store(&ws->list_armed, 0);
+    if (expired && websocket_send_connectionsDelta(ws, ws->clients) != 0)
+        websocket_schedule_connectionsDelta(ws); // Ring full: list_version did not move, the next window retries the same events
+}
+
+void websocket_schedule_connectionsDelta(websocket_service* ws) {
+    if (atomic_exchange(&ws->list_armed, 1)) return;
+    if (wheel_schedule(server_wheel, &ws->list_timer, LIST_UPDATE_WINDOW_MS) != 0) { // Shutting down, no window to batch into
+        atomic_store(&ws->list_armed, 0);
+        websocket_send_connectionsDelta(ws, ws->clients);
+    }
+}
+
+static void add_client_to_list(client* cli, void* arg) {
+    cJSON* client = cJSON_CreateObject();
+    if (!client) {
+        fprintf(stderr, "[ERROR] [websocket/add_client_to_list] cJSON_CreateObject fail\n");
+        return;
+    }
+    char id[CLIENT_ID_MAX];
+    client_formatId(cli->handle, id, sizeof(id));
+    cJSON_AddStringToObject(client, "id", id);
+    cJSON_AddStringToObject(client, "ip", cli->ip);
+    cJSON_AddItemToArray((cJSON*)arg, client);
+}
+
+static int send_snapshot(websocket_service* ws, slotTable* table) { // list_mutex held
+    cJSON* snapshot = cJSON_CreateObject();
+    cJSON* clients = snapshot ? cJSON_AddArrayToObject(snapshot, "clients") : NULL;
     if (!clients) {
-        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsList] cJSON_CreateArray fail");
+        fprintf(stderr, "[ERROR] [websocket/send_snapshot] cJSON_CreateObject fail\n");
+        cJSON_Delete(snapshot);
         return 1;
     }
-    pthread_mutex_lock(&hash_mutex);
-    for (int i = 0; i < hash->size; i++) {
-        Node* node = hash->buckets[i];
-        while (node) {
-            cJSON* client = cJSON_CreateObject();
-            if (!client) {
-                fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsList] cJSON_CreateObject fail");
-                return 1;
-            }
-            cJSON_AddStringToObject(client, "id", node->client->id);
-            cJSON_AddStringToObject(client, "ip", node->client->ip);
-            cJSON_AddItemToArray(clients, client);
-            node = node->next;
-        }
+    uint64_t version = slot_version(table); // Before the walk, changes made during it come again in the next delta
+    cJSON_AddNumberToObject(snapshot, "version", (double)version);
+    slot_forEach(table, add_client_to_list, clients);
+
+    int ret = push_listUpdate(ws, LIST_UPDATE, CONNECTION_LIST, 0, snapshot);
+    if (ret == 0) ws->list_version = version;
+    cJSON_Delete(snapshot);
+    return ret;
+}
+
+int websocket_send_connectionsList(websocket_service* ws, slotTable* table) {
+    pthread_mutex_lock(&ws->list_mutex);
+    int ret = send_snapshot(ws, table);
+    pthread_mutex_unlock(&ws->list_mutex);
+    return ret;
+}
+
+int websocket_send_connectionsDelta(websocket_service* ws, slotTable* table) {
+    pthread_mutex_lock(&ws->list_mutex);
+    registryEvent events[LIST_DELTA_BATCH];
+    uint64_t to = ws->list_version;
+    int n = slot_logRead(table, to, events, LIST_DELTA_BATCH);
+    if (n <= 0) { // Nothing new (another thread sent it already), or lapped
+        int ret = n == 0 ? 0 : send_snapshot(ws, table);
+        pthread_mutex_unlock(&ws->list_mutex);
+        return ret;
     }
-    pthread_mutex_unlock(&hash_mutex);
-    char* payload = cJSON_PrintUnformatted(clients);
 
-    PROTOCOL_MESSAGE* msg = protocol_create_msg(LIST_UPDATE, CONNECTION_LIST, REACTFRONT, CSERVER, NULL, payload, -1, strlen(payload));
-    if (!msg) {
-        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsList] protocol_create_msg fail");
+    cJSON* delta = cJSON_CreateObject();
+    cJSON* list = delta ? cJSON_AddArrayToObject(delta, "events") : NULL;
+    if (!list) {
+        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsDelta] cJSON_CreateObject fail\n");
+        cJSON_Delete(delta);
+        pthread_mutex_unlock(&ws->list_mutex);
         return 1;
     }
+    cJSON_AddNumberToObject(delta, "from", (double)ws->list_version);
+    while (n > 0) {
+        for (int i = 0; i < n; i++) {
+            cJSON* ev = cJSON_CreateObject();
+            if (!ev) break;
+            char id[CLIENT_ID_MAX];
+            client_formatId(events[i].handle, id, sizeof(id));
+            cJSON_AddStringToObject(ev, "op", registryOps[events[i].type]);
+            cJSON_AddNumberToObject(ev, "version", (double)events[i].version);
+            cJSON_AddStringToObject(ev, "id", id);
+            if (events[i].type != REGISTRY_REMOVED) cJSON_AddStringToObject(ev, "ip", events[i].ip);
+            cJSON_AddItemToArray(list, ev);
+            to = events[i].version;
+        }
+        n = n == LIST_DELTA_BATCH ? slot_logRead(table, to, events, LIST_DELTA_BATCH) : 0;
+    }
+    if (n == -1) { // Lapped while copying, the snapshot supersedes the partial delta
+        cJSON_Delete(delta);
+        int ret = send_snapshot(ws, table);
+        pthread_mutex_unlock(&ws->list_mutex);
+        return ret;
+    }
+    cJSON_AddNumberToObject(delta, "to", (double)to);
 
-    char* jsonMsg = protocol_create_jsonMsg(msg);
-    if (!jsonMsg) {
-        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsList] protocol_create_jsonMsg fail");
+    int ret = push_listUpdate(ws, LIST_UPDATE, CONNECTION_DELTA, 0, delta);
+    if (ret == 0) ws->list_version = to; // On failure the same events go out with the next change
+    cJSON_Delete(delta);
+    pthread_mutex_unlock(&ws->list_mutex);
+    return ret;
+}
+
+static void index_keyByIp(const connEntry* entry, char* key) {
+    snprintf(key, LIST_CURSOR_MAX, "%s %s", entry->ip, entry->id); // ' ' sorts before digits & '.', so entries group by IP
+}
+
+static void index_freeEntry(void* entry) {
+    pool_free(&connEntry_pool, entry);
+}
+
+static void index_remove(websocket_service* ws, clientHandle handle) {
+    char id[CLIENT_ID_MAX];
+    char key[LIST_CURSOR_MAX];
+    client_formatId(handle, id, sizeof(id));
+    connEntry* entry = skip_remove(ws->index_byId, id);
+    if (!entry) return; // Already gone, events replayed over a rebuild are idempotent
+    index_keyByIp(entry, key);
+    skip_remove(ws->index_byIp, key);
+    index_freeEntry(entry);
+}
+
+static int index_upsert(websocket_service* ws, clientHandle handle, const char* ip) {
+    char id[CLIENT_ID_MAX];
+    char key[LIST_CURSOR_MAX];
+    client_formatId(handle, id, sizeof(id));
+    connEntry* entry = skip_find(ws->index_byId, id);
+    if (entry) {
+        if (strcmp(entry->ip, ip) == 0) return 0;
+        index_remove(ws, handle); // IP changed, its by-IP key moves
+    }
+
+    entry = pool_alloc(&connEntry_pool);
+    if (!entry) {
+        fprintf(stderr, "[ERROR] [websocket/index_upsert] Failed to allocate memory for connEntry\n");
+        return 1;
+    }
+    entry->handle = handle;
+    snprintf(entry->id, sizeof(entry->id), "%s", id);
+    snprintf(entry->ip, sizeof(entry->ip), "%s", ip);
+    index_keyByIp(entry, key);
+    if (skip_insert(ws->index_byId, entry->id, entry) != 0) {
+        index_freeEntry(entry);
+        return 1;
+    }
+    if (skip_insert(ws->index_byIp, key, entry) != 0) {
+        skip_remove(ws->index_byId, entry->id);
+        index_freeEntry(entry);
         return 1;
     }
+    return 0;
+}
 
-    if (websocket_send(ws, jsonMsg) != 0) {
-        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsList] websocket_send fail");
+static void index_addClient(client* cli, void* arg) {
+    index_upsert((websocket_service*)arg, cli->handle, cli->ip);
+}
+
+static void index_rebuild(websocket_service* ws, slotTable* table) {
+    skip_clear(ws->index_byIp, NULL);
+    skip_clear(ws->index_byId, index_freeEntry);
+    ws->index_version = slot_version(table); // Before the walk, like a snapshot
+    slot_forEach(table, index_addClient, ws);
+}
+
+// Replays the change log into the indexes, O(changes since the last page)
+static void index_sync(websocket_service* ws, slotTable* table) {
+    registryEvent events[LIST_DELTA_BATCH];
+    int n;
+    while ((n = slot_logRead(table, ws->index_version, events, LIST_DELTA_BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (events[i].type == REGISTRY_REMOVED) index_remove(ws, events[i].handle);
+            else index_upsert(ws, events[i].handle, events[i].ip);
+            ws->index_version = events[i].version;
+        }
+        if (n < LIST_DELTA_BATCH) break;
+    }
+    if (n == -1) index_rebuild(ws, table);
+}
+
+// Rank of the first key past every key starting with prefix
+static size_t index_prefixEnd(skiplist* index, const char* prefix) {
+    size_t len = strlen(prefix);
+    if (len == 0) return index->count;
+    char bound[LIST_CURSOR_MAX];
+    memcpy(bound, prefix, len + 1);
+    bound[len - 1]++; // Prefixes are printable ASCII (decode_queryString() rejects the rest), no carry
+    size_t rank;
+    skip_lowerBound(index, bound, &rank);
+    return rank;
+}
+
+int websocket_send_connectionsPage(websocket_service* ws, slotTable* table, const connectionQuery* query, uint32_t request_id) {
+    index_sync(ws, table);
+
+    int byIp = query->ip_prefix[0] != '\0';
+    skiplist* index = byIp ? ws->index_byIp : ws->index_byId;
+    const char* prefix = byIp ? query->ip_prefix : query->id_prefix;
+    int filtered = byIp && query->id_prefix[0] != '\0'; // Second filter checked per entry
+    size_t idLen = strlen(query->id_prefix);
+    uint32_t limit = query->limit ? query->limit : LIST_PAGE_DEFAULT;
+
+    size_t first, pos;
+    skip_lowerBound(index, prefix, &first);
+    size_t end = index_prefixEnd(index, prefix);
+    if (end < first) end = first; // Never for printable prefixes, but total must not underflow
+    if (query->cursor[0] != '\0') {
+        skipNode* at = skip_lowerBound(index, query->cursor, &pos);
+        if (at && strcmp(at->key, query->cursor) == 0) pos++; // Strictly after the cursor
+        if (pos < first) pos = first;
+    } else {
+        pos = first + query->offset;
+    }
+
+    cJSON* page = cJSON_CreateObject();
+    cJSON* clients = page ? cJSON_AddArrayToObject(page, "clients") : NULL;
+    if (!clients) {
+        fprintf(stderr, "[ERROR] [websocket/websocket_send_connectionsPage] cJSON_CreateObject fail\n");
+        cJSON_Delete(page);
         return 1;
     }
+    cJSON_AddNumberToObject(page, "version", (double)ws->index_version);
+    if (!filtered) {
+        cJSON_AddNumberToObject(page, "total", (double)(end - first));
+        cJSON_AddNumberToObject(page, "offset", (double)(pos < end ? pos - first : end - first));
+    }
 
-    free(jsonMsg);
-    free(payload);
-    delete_protocol_msg(msg);
-    cJSON_Delete(clients);
-    return 0;
+    skipNode* node = pos < end ? skip_at(index, pos) : NULL;
+    const char* last = NULL;
+    uint32_t count = 0;
+    for (; node && pos < end && count < limit; node = skip_next(node), pos++) {
+        connEntry* entry = node->value;
+        last = node->key;
+        if (filtered && strncmp(entry->id, query->id_prefix, idLen) != 0) continue;
+        cJSON* client = cJSON_CreateObject();
+        if (!client) break;
+        cJSON_AddStringToObject(client, "id", entry->id);
+        cJSON_AddStringToObject(client, "ip", entry->ip);
+        cJSON_AddItemToArray(clients, client);
+        count++;
+    }
+    if (pos < end && last) cJSON_AddStringToObject(page, "next_cursor", last);
+
+    int ret = push_listUpdate(ws, RESPONSE, CONNECTION_LIST, request_id, page);
+    cJSON_Delete(page);
+    return ret;
 }
 
+/*
+ *
+ * PERMESSAGE-DEFLATE (RFC 7692):
+ * OFFERED THROUGH lws's OWN EXTENSION, WHICH CHECKS THE HANDSHAKE & INFLATES WHAT THE SERVER SENDS US COMPRESSED
+ *
+ *      OUR FRAMES GO OUT AS LWS_WRITE_RAW, PAST lws's EXTENSIONS, SO THEY ARE DEFLATED HERE: RAW DEFLATE, Z_SYNC_FLUSH,
+ *      THE TRAILING 00 00 ff ff DROPPED, RSV1 SET. client_no_context_takeover IS OFFERED, THE STREAM IS RESET PER MESSAGE
+ *      WHAT THE SERVER ACCEPTED IS READ BACK FROM ITS Sec-WebSocket-Extensions ON CLIENT_FILTER_PRE_ESTABLISH
+ *      OUTPUTS UNDER WS_DEFLATE_MIN_SIZE, OR NOT SMALLER ONCE COMPRESSED, GO OUT AS THEY ARE
+ *
+ * EVERY COMPRESSED MESSAGE LOGS ITS RATIO & THREAD CPU TIME, THE TOTALS ARE PRINTED BY websocket_destroy()
+ *
+ */
 static const struct lws_extension exts[] = {
+    { "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_no_context_takeover; client_max_window_bits" },
     { NULL, NULL, NULL }
 };
 
+static void deflate_negotiate(websocket_service* service, struct lws* wsi) {
+    char accepted[256];
+    service->deflate = 0;
+    if (lws_hdr_copy(wsi, accepted, sizeof(accepted), WSI_TOKEN_EXTENSIONS) <= 0 || !strstr(accepted, "permessage-deflate")) {
+        printf("permessage-deflate not accepted by the server, sending uncompressed\n");
+        return;
+    }
+    int bits = WS_DEFLATE_WINDOW_BITS;
+    const char* max = strstr(accepted, "client_max_window_bits=");
+    if (max) {
+        int server_max = atoi(max + strlen("client_max_window_bits="));
+        if (server_max < 9) { // zlib's raw deflate can not go under 9 bits
+            printf("permessage-deflate: client_max_window_bits=%d is below what zlib can do, sending uncompressed\n", server_max);
+            return;
+        }
+        if (server_max < bits) bits = server_max;
+    }
+
+    if (service->deflater_ready) deflateEnd(&service->deflater);
+    memset(&service->deflater, 0, sizeof(service->deflater));
+    service->deflater_ready = deflateInit2(&service->deflater, WS_DEFLATE_LEVEL, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    if (!service->deflater_ready) {
+        fprintf(stderr, "[ERROR] [websocket/deflate_negotiate] deflateInit2 failed, sending uncompressed\n");
+        return;
+    }
+    service->deflate = 1;
+    printf("permessage-deflate negotiated: level %d, %d window bits, min size %d\n", WS_DEFLATE_LEVEL, bits, WS_DEFLATE_MIN_SIZE);
+}
+
+static uint64_t thread_cpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Swaps msg->buffer for its compressed form when that pays off, 1 if it did
+static int deflate_message(websocket_service* service, wsMessage* msg) {
+    if (!service->deflate || msg->len < WS_DEFLATE_MIN_SIZE) return 0;
+    wsDeflateStats* stats = &service->deflate_stats;
+    if (msg->len > UINT_MAX) { // Past what one z_stream call takes
+        stats->skipped++;
+        return 0;
+    }
+    z_stream* z = &service->deflater;
+    size_t capacity = deflateBound(z, msg->len) + 6; // Z_SYNC_FLUSH adds an empty stored block on top of the bound
+    char* out = pool_bufAlloc(LWS_PRE + capacity);
+    if (!out) {
+        fprintf(stderr, "[ERROR] [websocket/deflate_message] Failed to allocate %zu bytes, sending uncompressed\n", capacity);
+        return 0;
+    }
+
+    uint64_t start = thread_cpuNs();
+    deflateReset(z);
+    z->next_in = (Bytef*)(msg->buffer + LWS_PRE);
+    z->avail_in = (uInt)msg->len;
+    z->next_out = (Bytef*)(out + LWS_PRE);
+    z->avail_out = (uInt)capacity;
+    int ret = deflate(z, Z_SYNC_FLUSH);
+    uint64_t cpu = thread_cpuNs() - start;
+    size_t compressed = capacity - z->avail_out;
+
+    if (ret != Z_OK || z->avail_in != 0 || compressed < 4 || compressed - 4 >= msg->len) {
+        pool_bufFree(out);
+        stats->skipped++;
+        stats->cpu_ns += cpu;
+        return 0;
+    }
+    compressed -= 4; // 00 00 ff ff, the receiver appends it back
+    stats->messages++;
+    stats->bytes_in += msg->len;
+    stats->bytes_out += compressed;
+    stats->cpu_ns += cpu;
+
+    pool_bufFree(msg->buffer);
+    msg->buffer = out;
+    msg->len = compressed;
+    return 1;
+}
+
+/*
+ *
+ * MASKING:
+ * EVERY CLIENT FRAME IS XORed WITH ITS 4-BYTE KEY, A MULTI-MEGABYTE OUTPUT IS MASKED IN PLACE BEFORE IT IS SENT
+ *
+ *      THE KEY IS REPEATED ACROSS A WORD: 32 BYTES PER STEP WITH AVX2 (PICKED AT RUNTIME), 16 WITH SSE2, 8 IN PLAIN C
+ *      EVERY STEP IS A MULTIPLE OF 4 BYTES, SO THE KEY NEVER SHIFTS, ONLY THE LAST < 8 BYTES GO ONE AT A TIME
+ *      KEYS COME FROM A PER-THREAD BUFFER FILLED BY getrandom(), ONE SYSCALL PER MASK_KEY_BATCH FRAMES
+ *
+ */
+#define MASK_KEY_BATCH 64 // Keys per getrandom()
+
+static _Thread_local unsigned char mask_keys[MASK_KEY_BATCH * 4];
+static _Thread_local size_t mask_keys_left;
+
 static void generate_masking_key(unsigned char* key) {
-    for (int i = 0; i < 4; i++) {
-        key[i] = rand() % 256;
+    if (mask_keys_left == 0) {
+        if (getrandom(mask_keys, sizeof(mask_keys), 0) != (ssize_t)sizeof(mask_keys)) {
+            fprintf(stderr, "[ERROR] [websocket/generate_masking_key] getrandom failed, falling back to rand()\n");
+            for (size_t i = 0; i < sizeof(mask_keys); i++)
+                mask_keys[i] = rand() % 256;
+        }
+        mask_keys_left = MASK_KEY_BATCH;
     }
+    mask_keys_left--;
+    memcpy(key, mask_keys + mask_keys_left * 4, 4);
 }
 
-static void apply_mask(unsigned char* data, size_t len, unsigned char* mask) {
-    for (size_t i = 0; i < len; i++) {
-        data[i] ^= mask[i % 4];
+static void mask_words(unsigned char* data, size_t len, uint32_t key) {
+    uint64_t key64 = (uint64_t)key << 32 | key;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x;
+        memcpy(&x, data + i, 8);
+        x ^= key64;
+        memcpy(data + i, &x, 8);
     }
+    const unsigned char* k = (const unsigned char*)&key;
+    for (; i < len; i++)
+        data[i] ^= k[i & 3];
 }
 
-static int send_raw_message(struct lws* wsi, const char* message) {
-    int fd = lws_get_socket_fd(wsi);
-    if (fd < 0) {
-        fprintf(stderr, "[ERROR] Invalid socket fd\n");
-        return -1;
+#if defined(__x86_64__)
+static void mask_sse2(unsigned char* data, size_t len, uint32_t key) {
+    __m128i k = _mm_set1_epi32((int)key);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(x, k));
     }
+    mask_words(data + i, len - i, key);
+}
 
-    size_t payload_len = strlen(message);
-    unsigned char frame[14 + payload_len];
-    unsigned char* p = frame;
-    unsigned char mask_key[4];
+__attribute__((target("avx2")))
+static void mask_avx2(unsigned char* data, size_t len, uint32_t key) {
+    __m256i k = _mm256_set1_epi32((int)key);
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) { // 4 independent loads per step keep both load ports busy
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(data + i + 96));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i*)(data + i + 32), _mm256_xor_si256(b, k));
+        _mm256_storeu_si256((__m256i*)(data + i + 64), _mm256_xor_si256(c, k));
+        _mm256_storeu_si256((__m256i*)(data + i + 96), _mm256_xor_si256(d, k));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(x, k));
+    }
+    mask_words(data + i, len - i, key);
+}
+#endif
+
+static void (*mask_kernel)(unsigned char* data, size_t len, uint32_t key) = mask_words; // Set by websocket_init()
 
+static void mask_selectKernel() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    mask_kernel = __builtin_cpu_supports("avx2") ? mask_avx2 : mask_sse2; // SSE2 is part of x86-64
+#endif
+}
+
+static void apply_mask(unsigned char* data, size_t len, unsigned char* mask) {
+    uint32_t key;
+    memcpy(&key, mask, 4); // Byte order kept: byte n of the word masks byte n of every 4
+    mask_kernel(data, len, key);
+}
+
+#define WS_FRAME_FIN 0x80 // Last frame of the message
+#define WS_FRAME_RSV1 0x40 // permessage-deflate: the message is compressed, first frame only
+#define WS_OPCODE_CONTINUATION 0x00
+#define WS_OPCODE_TEXT 0x01
+
+// Frames message where it lies: the header goes into the LWS_PRE bytes before it, the payload is masked in place
+_Static_assert(LWS_PRE >= 14, "LWS_PRE must hold the largest client frame header"); // 2 + 8 length bytes + 4 mask bytes
+static unsigned char* websocket_frame(char* message, size_t payload_len, unsigned char first, size_t* frame_len) {
+    unsigned char mask_key[4];
     generate_masking_key(mask_key);
 
-    *p = 0x81;
+    size_t header_len = 2 + (payload_len < 126 ? 0 : payload_len <= 65535 ? 2 : 8) + 4;
+    unsigned char* frame = (unsigned char*)message - header_len;
+    unsigned char* p = frame;
+
+    *p = first; // FIN, RSV1 & opcode
     p++;
 
     if (payload_len < 126) {
@@ -98,40 +551,146 @@ static int send_raw_message(struct lws* wsi, const char* message) {
     } else {
         *p = 127 | 0x80;
         p++;
-        memset(p, 0, 7);
-        p += 7;
-        *p = (payload_len >> 56) & 0xFF;
-        p++;
-        *p = (payload_len >> 48) & 0xFF;
-        p++;
-        *p = (payload_len >> 40) & 0xFF;
-        p++;
-        *p = (payload_len >> 32) & 0xFF;
-        p++;
-        *p = (payload_len >> 24) & 0xFF;
-        p++;
-        *p = (payload_len >> 16) & 0xFF;
-        p++;
-        *p = (payload_len >> 8) & 0xFF;
-        p++;
-        *p = payload_len & 0xFF;
-        p++;
+        for (int shift = 56; shift >= 0; shift -= 8) { // 64-bit length, most significant byte first
+            *p = (payload_len >> shift) & 0xFF;
+            p++;
+        }
     }
 
     memcpy(p, mask_key, 4);
-    p += 4;
 
-    memcpy(p, message, payload_len);
-    p += payload_len;
+    apply_mask((unsigned char*)message, payload_len, mask_key);
 
-    apply_mask(p - payload_len, payload_len, mask_key);
+    *frame_len = header_len + payload_len;
+    return frame;
+}
 
-    ssize_t sent = write(fd, frame, p - frame);
-    if (sent < 0) {
-        perror("[ERROR] write in send_raw_message failed");
-        return -1;
+static int ring_pop(wsRing* ring, wsMessage* out) {
+    pthread_mutex_lock(&ring->mutex);
+    if (ring->count == 0) {
+        pthread_mutex_unlock(&ring->mutex);
+        return 0;
+    }
+    *out = ring->slots[ring->head];
+    ring->head = (ring->head + 1) % WS_RING_SLOTS;
+    ring->count--;
+    if (ring->urgent > 0) ring->urgent--;
+    ring->bytes -= out->len;
+    pthread_cond_broadcast(&ring->notFull); // The freed bytes may fit several waiting outputs
+    pthread_mutex_unlock(&ring->mutex);
+    return 1;
+}
+
+static void ring_clear(wsRing* ring) {
+    wsMessage msg;
+    while (ring_pop(ring, &msg))
+        pool_bufFree(msg.buffer);
+}
+
+static void fragment_drop(websocket_service* service) {
+    pool_bufFree(service->fragmenting.buffer);
+    service->fragmenting.buffer = NULL;
+}
+
+// Frames the next WS_FRAGMENT_SIZE bytes of fragmenting in place, its header overwrites the end of the previous fragment
+// Safe as long as that one was sent (or copied by lws) first, which is why a fragment always ends its batch
+static void fragment_next(websocket_service* service, struct iovec* iov) {
+    wsMessage* msg = &service->fragmenting;
+    size_t offset = service->fragment_offset;
+    size_t len = msg->len - offset < WS_FRAGMENT_SIZE ? msg->len - offset : WS_FRAGMENT_SIZE;
+    unsigned char first = offset == 0 ? WS_OPCODE_TEXT | service->fragment_rsv : WS_OPCODE_CONTINUATION;
+    if (offset + len == msg->len) first |= WS_FRAME_FIN;
+
+    size_t frame_len;
+    iov->iov_base = websocket_frame(msg->buffer + LWS_PRE + offset, len, first, &frame_len);
+    iov->iov_len = frame_len;
+    service->fragment_offset = offset + len;
+}
+
+// Whatever the socket did not take goes to lws, which sends it before anything else (its own control frames included)
+static int websocket_sendFrames(struct lws* wsi, int fd, struct iovec* iov, int count) {
+    ssize_t sent = 0;
+    if (fd >= 0) {
+        struct msghdr batch = { .msg_iov = iov, .msg_iovlen = count };
+        sent = sendmsg(fd, &batch, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("[ERROR] [websocket/websocket_sendFrames] sendmsg failed");
+                return -1;
+            }
+            sent = 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if ((size_t)sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        if (lws_write(wsi, (unsigned char*)iov[i].iov_base + sent, iov[i].iov_len - sent, LWS_WRITE_RAW) < 0) // Already framed
+            return -1;
+        sent = 0;
     }
-    printf("Sent raw message: %s (bytes: %zd, frame size: %zu)\n", message, sent, p - frame);
+    return 0;
+}
+
+/*
+ * LWS_CALLBACK_CLIENT_WRITEABLE: UP TO WS_IOV_MAX FRAMES PER sendmsg(), EACH ONE iovec (ITS HEADER SITS IN THE HEADROOM RIGHT BEFORE IT)
+ * lws_send_pipe_choked() BEING FALSE MEANS lws HOLDS NO UNSENT BYTES, SO WRITING THE SOCKET DIRECTLY CAN NOT REORDER ANYTHING
+ * TLS HAS TO GO THROUGH lws_write(), ONE FRAME AT A TIME
+ * A MESSAGE OVER WS_FRAGMENT_SIZE ENDS THE BATCH WITH ITS FIRST FRAGMENT, EVERY LATER CALLBACK SENDS ITS NEXT ONE & NOTHING ELSE
+ */
+static int websocket_drain_output(websocket_service* service, struct lws* wsi) {
+    int fd = lws_is_ssl(wsi) ? -1 : lws_get_socket_fd(wsi);
+    int batch_max = fd < 0 ? 1 : WS_IOV_MAX;
+    size_t budget = WS_WRITE_BUDGET;
+    wsMessage batch[WS_IOV_MAX];
+    struct iovec iov[WS_IOV_MAX];
+
+    while (budget > 0 && !lws_send_pipe_choked(wsi)) {
+        int count = 0; // iovecs
+        int whole = 0; // Messages of batch[], sent in one frame
+        size_t total = 0;
+        if (service->fragmenting.buffer) { // No other data frame until its FIN
+            fragment_next(service, &iov[count++]);
+        } else {
+            while (count < batch_max && total < budget && ring_pop(&service->outbound, &batch[whole])) {
+                wsMessage* msg = &batch[whole];
+                unsigned char rsv = deflate_message(service, msg) ? WS_FRAME_RSV1 : 0;
+                if (msg->len > WS_FRAGMENT_SIZE) {
+                    service->fragmenting = *msg;
+                    service->fragment_offset = 0;
+                    service->fragment_rsv = rsv;
+                    fragment_next(service, &iov[count++]);
+                    break;
+                }
+                size_t frame_len;
+                iov[count].iov_base = websocket_frame(msg->buffer + LWS_PRE, msg->len, WS_FRAME_FIN | WS_OPCODE_TEXT | rsv, &frame_len);
+                iov[count].iov_len = frame_len;
+                total += frame_len;
+                count++;
+                whole++;
+            }
+        }
+        if (count == 0) break;
+
+        int ret = websocket_sendFrames(wsi, fd, iov, count);
+        for (int i = 0; i < whole; i++)
+            pool_bufFree(batch[i].buffer);
+        if (ret < 0) {
+            fprintf(stderr, "[ERROR] [websocket/websocket_drain_output] Send failed, closing the connection\n");
+            return -1; // fragmenting is dropped by CLIENT_CLOSED
+        }
+        if (service->fragmenting.buffer) {
+            if (service->fragment_offset == service->fragmenting.len) fragment_drop(service);
+            else break; // Yields to lws between fragments
+        }
+        budget = total < budget ? budget - total : 0;
+    }
+
+    pthread_mutex_lock(&service->outbound.mutex);
+    int more = service->outbound.count > 0;
+    pthread_mutex_unlock(&service->outbound.mutex);
+    if (more || service->fragmenting.buffer) lws_callback_on_writable(wsi);
     return 0;
 }
 
@@ -141,26 +700,40 @@ static int callback(struct lws* wsi [[maybe_unused]], enum lws_callback_reasons
         case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
             printf("Appending handshake headers\n");
             break;
+        case LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH: // The server's handshake response, its headers are still there
+            deflate_negotiate(websocket_global_wss, wsi);
+            break;
         case LWS_CALLBACK_WSI_CREATE:
             printf("WebSocket client WSI created\n");
             break;
         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
             fprintf(stderr, "WebSocket connection failed: %s\n", in ? (char*)in : "No error details");
-            *websocket_global_wss->running = 0;
+            websocket_global_wss->wsi = NULL; // Freed by lws, websocket_thread() retries
             break;
         case LWS_CALLBACK_ESTABLISHED:
+        case LWS_CALLBACK_CLIENT_ESTABLISHED: // This side is the client, ESTABLISHED alone never fired
             printf("WebSocket connected\n");
+            websocket_global_wss->connected = 1;
+            websocket_send_connectionsList(websocket_global_wss, websocket_global_wss->clients); // Base version for the deltas that follow
             break;
         case LWS_CALLBACK_CLIENT_WRITEABLE:
-            printf("Connection is writeable\n");
-            break;
+            return websocket_drain_output(websocket_global_wss, wsi);
         case LWS_CALLBACK_CLOSED:
+        case LWS_CALLBACK_CLIENT_CLOSED:
             printf("WebSocket disconnected\n");
-            *websocket_global_wss->running = 0;
+            websocket_global_wss->connected = 0;
+            websocket_global_wss->deflate = 0; // Renegotiated by the next handshake
+            fragment_drop(websocket_global_wss); // A new connection starts with a new message
+            ring_clear(&websocket_global_wss->outbound); // Nobody to send to, unblocks waiting agents
+            websocket_global_wss->wsi = NULL; // Freed by lws, websocket_thread() reconnects, only a shutdown clears running
+            break;
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED: // lws_cancel_service() from websocket_push_output
+            if (websocket_global_wss && websocket_global_wss->connected)
+                lws_callback_on_writable(websocket_global_wss->wsi); // Sent from CLIENT_WRITEABLE, when the socket can take it
             break;
         case LWS_CALLBACK_CLIENT_RECEIVE:
             printf("Received from web server: %.*s\n", (int)len, (char*)in);
-            handle_received_message((char*)in);
+            handle_received_message((char*)in, len);
             break;
         default:
             break;
@@ -173,15 +746,44 @@ static struct lws_protocols protocols[] = {
     {NULL, NULL, 0, 0, 0}
 };
 
-websocket_service* websocket_init(volatile sig_atomic_t* server_running, Queue* output_queue, hashMap* client_hash) {
+websocket_service* websocket_init(volatile sig_atomic_t* server_running, slotTable* clients) {
     websocket_service* service = malloc(sizeof(websocket_service));
     if (!service) {
         fprintf(stderr, "[ERROR] [websocket/websocket_init] Failed to allocate memory for websocket_service\n");
         return NULL;
     }
+    mask_selectKernel();
     service->running = server_running;
-    service->output_queue = output_queue;
-    service->client_hash = client_hash;
+    service->outbound.head = 0;
+    service->outbound.count = 0;
+    service->outbound.urgent = 0;
+    service->outbound.bytes = 0;
+    pthread_mutex_init(&service->outbound.mutex, NULL);
+    pthread_cond_init(&service->outbound.notFull, NULL);
+    service->connected = 0;
+    service->fragmenting.buffer = NULL;
+    service->fragment_offset = 0;
+    service->deflate = 0;
+    service->deflater_ready = 0;
+    memset(&service->deflate_stats, 0, sizeof(service->deflate_stats));
+    service->clients = clients;
+    service->list_version = 0;
+    pthread_mutex_init(&service->list_mutex, NULL);
+    wheel_nodeInit(&service->list_timer, on_list_window);
+    atomic_init(&service->list_armed, 0);
+    service->index_version = 0;
+    service->index_byId = skip_init();
+    service->index_byIp = skip_init();
+    if (!service->index_byId || !service->index_byIp) {
+        fprintf(stderr, "[ERROR] [websocket/websocket_init] Failed to create the connection indexes\n");
+        skip_destroy(service->index_byId, NULL);
+        skip_destroy(service->index_byIp, NULL);
+        pthread_mutex_destroy(&service->list_mutex);
+        pthread_mutex_destroy(&service->outbound.mutex);
+        pthread_cond_destroy(&service->outbound.notFull);
+        free(service);
+        return NULL;
+    }
 
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
@@ -194,6 +796,11 @@ websocket_service* websocket_init(volatile sig_atomic_t* server_running, Queue*
     service->context = lws_create_context(&info);
     if (!service->context) {
         fprintf(stderr, "[ERROR] [websocket/websocket_init] lws_create_context failed\n");
+        skip_destroy(service->index_byId, NULL);
+        skip_destroy(service->index_byIp, NULL);
+        pthread_mutex_destroy(&service->list_mutex);
+        pthread_mutex_destroy(&service->outbound.mutex);
+        pthread_cond_destroy(&service->outbound.notFull);
         free(service);
         return NULL;
     }
@@ -206,11 +813,16 @@ websocket_service* websocket_init(volatile sig_atomic_t* server_running, Queue*
     ccinfo.host = ccinfo.address;
     ccinfo.origin = ccinfo.address;
     ccinfo.protocol = protocols[0].name;
+    ccinfo.pwsi = &service->wsi; // Set by lws early & NULLed if the connection fails before the call returns
 
-    service->wsi = lws_client_connect_via_info(&ccinfo);
-    if (!service->wsi) {
+    if (!lws_client_connect_via_info(&ccinfo)) {
         fprintf(stderr, "[ERROR] [websocket/websocket_init] WebSocket client connect failed\n");
         lws_context_destroy(service->context);
+        skip_destroy(service->index_byId, NULL);
+        skip_destroy(service->index_byIp, NULL);
+        pthread_mutex_destroy(&service->list_mutex);
+        pthread_mutex_destroy(&service->outbound.mutex);
+        pthread_cond_destroy(&service->outbound.notFull);
         free(service);
         return NULL;
     }
@@ -221,16 +833,67 @@ websocket_service* websocket_init(volatile sig_atomic_t* server_running, Queue*
 void websocket_destroy(websocket_service* service) {
     if (service) {
         lws_context_destroy(service->context);
+        ring_clear(&service->outbound);
+        fragment_drop(service);
+        if (service->deflater_ready) deflateEnd(&service->deflater);
+        wsDeflateStats* stats = &service->deflate_stats;
+        printf("permessage-deflate: %llu messages compressed, %llu -> %llu bytes (%.1f%%), %.3f ms CPU, %llu sent uncompressed\n",
+               (unsigned long long)stats->messages, (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out,
+               stats->bytes_in ? 100.0 * stats->bytes_out / stats->bytes_in : 0.0, stats->cpu_ns / 1e6, (unsigned long long)stats->skipped);
+        pthread_mutex_destroy(&service->outbound.mutex);
+        pthread_cond_destroy(&service->outbound.notFull);
+        pthread_mutex_destroy(&service->list_mutex);
+        skip_destroy(service->index_byIp, NULL);
+        skip_destroy(service->index_byId, index_freeEntry); // Entries are shared, freed once
         free(service);
     }
 }
 
-int websocket_send(websocket_service* service, const char* message) {
-    if (!service || !service->wsi || lws_get_socket_fd(service->wsi) < 0) {
-        fprintf(stderr, "[ERROR] [websocket/websocket_send] Invalid WebSocket service or connection\n");
-        return -1;
+static int ring_push(websocket_service* service, char* buffer, size_t len, uint32_t wait_ms, int urgent) {
+    wsRing* ring = &service->outbound;
+    struct timespec deadline;
+    if (wait_ms) {
+        clock_gettime(CLOCK_REALTIME, &deadline); // pthread_cond_timedwait()'s default clock
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
     }
-    return send_raw_message(service->wsi, message);
+
+    pthread_mutex_lock(&ring->mutex);
+    // An output larger than WS_RING_MAX_BYTES still goes in alone, it would never fit otherwise
+    while (ring->count == WS_RING_SLOTS || (ring->count > 0 && ring->bytes + len > WS_RING_MAX_BYTES)) {
+        if (!wait_ms || pthread_cond_timedwait(&ring->notFull, &ring->mutex, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&ring->mutex);
+            return WS_RING_FULL;
+        }
+    }
+    size_t at = ring->count;
+    if (urgent) { // Opens a slot before head & moves the earlier urgent messages into it, this one lands right behind them
+        ring->head = (ring->head + WS_RING_SLOTS - 1) % WS_RING_SLOTS;
+        for (size_t i = 0; i < ring->urgent; i++)
+            ring->slots[(ring->head + i) % WS_RING_SLOTS] = ring->slots[(ring->head + i + 1) % WS_RING_SLOTS];
+        at = ring->urgent++;
+    }
+    ring->slots[(ring->head + at) % WS_RING_SLOTS] = (wsMessage){ .buffer = buffer, .len = len };
+    ring->count++;
+    ring->bytes += len;
+    pthread_mutex_unlock(&ring->mutex);
+
+    lws_cancel_service(service->context); // Wakes lws_service(), LWS_CALLBACK_EVENT_WAIT_CANCELLED asks for CLIENT_WRITEABLE
+    return 0;
+}
+
+int websocket_push_output(websocket_service* service, char* buffer, size_t len, uint32_t wait_ms) {
+    if (!service) return -1;
+    return ring_push(service, buffer, len, wait_ms, 0);
+}
+
+int websocket_push_urgent(websocket_service* service, char* buffer, size_t len) {
+    if (!service) return -1;
+    return ring_push(service, buffer, len, 0, 1);
 }
 
 void* websocket_thread(void* arg) {
@@ -244,33 +907,24 @@ void* websocket_thread(void* arg) {
     ccinfo.host = ccinfo.address;
     ccinfo.origin = ccinfo.address;
     ccinfo.protocol = protocols[0].name;
+    ccinfo.pwsi = &service->wsi;
 
 
+    time_t last_attempt = time(NULL); // websocket_init() made the first one
     while (*service->running) {
 
-        lws_service(service->context, 5);
+        lws_service(service->context, 0); // Blocks until socket activity, an lws timer or lws_cancel_service()
 
-        if (!service->wsi || lws_get_socket_fd(service->wsi) < 0) {
+        if (!service->wsi) { // Cleared by CLIENT_CLOSED / CLIENT_CONNECTION_ERROR, both on this thread
+            time_t wait = last_attempt + WS_RECONNECT_DELAY - time(NULL);
+            if (wait > 0) sleep(wait); // A failed attempt is reported asynchronously, this paces the retries
+            if (!*service->running) break;
             fprintf(stderr, "[INFO] WebSocket connection lost, attempting to reconnect...\n");
-            service->wsi = lws_client_connect_via_info(&ccinfo);
-            if (!service->wsi) {
+            last_attempt = time(NULL);
+            if (!lws_client_connect_via_info(&ccinfo)) {
                 fprintf(stderr, "[ERROR] WebSocket reconnect failed\n");
-                sleep(5); // Wait before retrying
                 continue;
             }
-            fprintf(stderr, "[INFO] WebSocket reconnected\n");
-        }
-
-        char* output = queue_pop(service->output_queue);
-        if (output) {
-            if (websocket_send(service, output) < 0) {
-                fprintf(stderr, "[ERROR] [websocket/websocket_thread] Failed to send raw message\n");
-            } else {
-                printf("Successfully sent raw message\n");
-            }
-            free(output);
-        } else {
-            printf("No message in queue, serviced libwebsockets\n");
         }
     }
     return NULL;
@@ -3,24 +3,117 @@
 
 #include <libwebsockets.h>
 #include "client_mgmt.h"
+#include "timerwheel.h"
+#include "skiplist.h"
 #include <signal.h>
+#include <zlib.h>
+
+#define LIST_UPDATE_WINDOW_MS 50 // Registry changes are batched into one CONNECTION_DELTA per window, sent at most window + WHEEL_TICK_MS after the first
+#define LIST_PAGE_DEFAULT 100 // Clients per CONNECTION_LIST page when the query has no "limit"
+#define LIST_PAGE_MAX 1000
+#define LIST_CURSOR_MAX (INET_ADDRSTRLEN + CLIENT_ID_MAX) // Index key: "cliN", or "ip cliN" when filtering by IP
+
+#define WS_RING_SLOTS 1024 // Messages queued for the frontend
+#define WS_RING_MAX_BYTES (16 << 20) // Serialized bytes queued, the ring is full at whichever bound comes first
+#define WS_PUSH_WAIT_MS 1000 // How long an agent's output waits for room before it is dropped
+#define WS_WRITE_BUDGET (1 << 20) // Bytes handed to lws per WRITEABLE callback before yielding to its other I/O
+#define WS_IOV_MAX 64 // Frames gathered into one sendmsg()
+#define WS_FRAGMENT_SIZE (64 << 10) // Larger messages go out as continuation frames of this size, one per WRITEABLE callback
+#define WS_RING_FULL 1 // websocket_push_output(): still full after wait_ms
+#define WS_RECONNECT_DELAY 5 // Seconds between attempts to (re)connect to the web server
+#define WS_DEFLATE_MIN_SIZE 1024 // Smaller outputs are sent uncompressed, deflate would cost more than it saves
+#define WS_DEFLATE_LEVEL 6 // zlib level, 1 fastest ... 9 smallest, lower it if the web thread's CPU is the bottleneck
+#define WS_DEFLATE_WINDOW_BITS 15 // 9 to 15, lowered to the server's client_max_window_bits, less memory & ratio
+
+/*
+ *
+ * OUTBOUND RING:
+ * EVERY MESSAGE FOR THE FRONTEND IS A BUFFER FROM protocol_create_jsonMsg(), QUEUED HERE BY ANY THREAD
+ *
+ *      ONLY THE WEB THREAD WRITES TO THE SOCKET: lws_cancel_service() -> lws_callback_on_writable() -> LWS_CALLBACK_CLIENT_WRITEABLE
+ *      WHICH FRAMES EACH MESSAGE IN PLACE & SENDS A BATCH OF THEM PER sendmsg() UNTIL THE PIPE CHOKES, lws BUFFERS A PARTIAL WRITE
+ *      A FULL RING IS BACKPRESSURE: AGENT WORKERS WAIT ON notFull (THEIR recv() PAUSES, TCP SLOWS THE AGENT DOWN)
+ *      THREADS THAT MUST NOT BLOCK (EPOLL LOOP, WEB THREAD) PUSH WITH wait_ms = 0 & DROP ON WS_RING_FULL
+ *      websocket_push_urgent() (LIST_UPDATE) QUEUES AHEAD OF EVERY OUTPUT, BEHIND EARLIER URGENT MESSAGES ONLY
+ *
+ * FRAGMENTATION (RFC 6455 5.4):
+ *      A MESSAGE OVER WS_FRAGMENT_SIZE IS SENT AS A TEXT FRAME WITHOUT FIN, CONTINUATION FRAMES, THEN ONE WITH FIN
+ *      ONE FRAGMENT PER WRITEABLE CALLBACK: lws's OWN PING / PONG / CLOSE GO OUT BETWEEN THEM
+ *      NO OTHER MESSAGE MAY INTERLEAVE, AN URGENT ONE GOES RIGHT AFTER THE LAST FRAGMENT
+ *      ONLY A MESSAGE ALREADY WHOLE IN THE RING IS SLICED, IT STAYS IN MEMORY UNTIL ITS LAST FRAGMENT IS SENT
+ *      AGENT OUTPUT IS NOT STREAMED THIS WAY: EVERY <= WIRE_CHUNK_SIZE CHUNK IS ITS OWN RESPONSE, FAR BELOW WS_FRAGMENT_SIZE
+ *      SO IN PRACTICE ONLY LARGE LIST_UPDATE SNAPSHOTS ARE FRAGMENTED
+ *
+ */
+typedef struct wsMessage {
+    char* buffer; // Pool buffer, LWS_PRE bytes of headroom then len bytes of JSON
+    size_t len;
+} wsMessage;
+
+typedef struct wsRing {
+    wsMessage slots[WS_RING_SLOTS];
+    size_t head; // Next to send
+    size_t count;
+    size_t urgent; // The first urgent messages from head on
+    size_t bytes;
+    pthread_mutex_t mutex;
+    pthread_cond_t notFull;
+} wsRing;
+
+typedef struct wsDeflateStats { // Web thread only
+    uint64_t messages; // Sent compressed
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_ns; // Thread CPU time inside deflate(), skipped messages included
+    uint64_t skipped; // Not smaller once compressed
+} wsDeflateStats;
+
+typedef struct connectionQuery { // "query" object of a REQUEST : CONNECTION_LIST, a page instead of the full snapshot
+    uint32_t offset; // Into the filtered range, ignored when cursor is set
+    uint32_t limit; // 0 for LIST_PAGE_DEFAULT
+    char cursor[LIST_CURSOR_MAX]; // next_cursor of the previous page, "" for the first
+    char id_prefix[CLIENT_ID_MAX];
+    char ip_prefix[INET_ADDRSTRLEN];
+} connectionQuery;
 
 typedef struct websocket_service {
     struct lws_context* context;
     struct lws* wsi;
-    struct lws_client_connect_info* ccinfo:
+    struct lws_client_connect_info* ccinfo;
     volatile sig_atomic_t* running;
-    Queue* output_queue;
-    hashMap* client_hash;
+    wsRing outbound;
+    int connected; // Web thread only, between CLIENT_ESTABLISHED & CLOSED
+    wsMessage fragmenting; // Web thread only, popped & partly sent, buffer NULL when none
+    size_t fragment_offset; // Payload bytes of fragmenting already framed
+    unsigned char fragment_rsv; // RSV1 if fragmenting is compressed, set on its first fragment only
+    int deflate; // Web thread only, permessage-deflate accepted on the current connection
+    int deflater_ready;
+    z_stream deflater; // Raw deflate, reset for every message
+    wsDeflateStats deflate_stats;
+    slotTable* clients;
+    uint64_t list_version; // Last registry version queued for the frontend, deltas start right after it
+    pthread_mutex_t list_mutex; // Keeps deltas & snapshots in version order, without gaps or overlaps
+    timerNode list_timer; // On server_wheel, closes the current LIST_UPDATE_WINDOW_MS window
+    atomic_int list_armed; // A window is open, further changes ride along with it
+    skiplist* index_byId; // Web thread only, connEntry by "cliN", answers CONNECTION_LIST pages
+    skiplist* index_byIp; // Same entries by "ip cliN"
+    uint64_t index_version; // Change log version the indexes are caught up to
 } websocket_service;
 
 extern websocket_service* websocket_global_wss;
 
-int websocket_send_connectionsList(websocket_service* ws, hashMap* hash);
+int websocket_send_connectionsList(websocket_service* ws, slotTable* clients); // Full snapshot, on request or resync
+
+int websocket_send_connectionsPage(websocket_service* ws, slotTable* clients, const connectionQuery* query, uint32_t request_id); // Web thread only
+
+int websocket_send_connectionsDelta(websocket_service* ws, slotTable* clients); // Registry changes not sent yet
+
+void websocket_schedule_connectionsDelta(websocket_service* ws); // After every connect/disconnect, opens a window unless one is open
 
-websocket_service* websocket_init(volatile sig_atomic_t* server_running, Queue* output_queue, hashMap* client_hash);
+websocket_service* websocket_init(volatile sig_atomic_t* server_running, slotTable* clients);
 void websocket_destroy(websocket_service* service);
-int websocket_send(websocket_service* service, const char* message);
+int websocket_push_output(websocket_service* service, char* buffer, size_t len, uint32_t wait_ms); // 0: the ring owns buffer, else the caller keeps it
+int websocket_push_urgent(websocket_service* service, char* buffer, size_t len); // Never waits, same ownership rule
 void* websocket_thread(void* arg);
 
 #endif
@@ -0,0 +1,181 @@
+#ifndef WIRE_H_INCLUDED
+#define WIRE_H_INCLUDED
+
+
+#ifndef WIRE // Include guard
+#define WIRE
+
+#include "common.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#define WIRE_HEADER_SIZE 9 // u32 payload length + u8 type + u32 request_id, network byte order
+#define WIRE_DEADLINE_SIZE 4 // u32 timeout_ms heading a WIRE_COMMAND's payload, network byte order
+#define WIRE_MAX_PAYLOAD (1u << 20) // 1 MiB, a bigger length means a corrupt stream & drops the connection
+#define WIRE_RECV_CHUNK 16384 // Minimum free space offered to recv()
+#define WIRE_CHUNK_SIZE 4096 // Max WIRE_OUTPUT payload the agent sends, bounds its memory per command
+#define WIRE_BEACON_INTERVAL 5000 // ms between two WIRE_BEACONs from an agent
+#define WIRE_SILENCE_TIMEOUT (3 * WIRE_BEACON_INTERVAL) // ms without a single byte before the server evicts an agent
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Windows has no SIGPIPE
+#endif
+
+/*
+ *
+ * AGENT WIRE PROTOCOL (SERVER <-> client.c, TCP):
+ * EVERY MESSAGE IS ONE FRAME:  [ length : 4 ][ type : 1 ][ request_id : 4 ][ payload : length ]
+ *
+ *      A recv() MAY RETURN HALF A FRAME OR SEVERAL FRAMES, EACH END KEEPS A wireBuffer PER CONNECTION
+ *      recv() GOES STRAIGHT INTO wire_bufferReserve(), wire_nextFrame() HANDS OUT EVERY COMPLETE FRAME
+ *      request_id IS ECHOED BACK BY THE AGENT, SO SEVERAL COMMANDS CAN BE IN FLIGHT ON ONE CONNECTION
+ *      OUTPUT IS STREAMED:  WIRE_OUTPUT_START, WIRE_OUTPUT / WIRE_OUTPUT_STDERR * N (<= WIRE_CHUNK_SIZE EACH), WIRE_OUTPUT_END
+ *      THE AGENT SENDS A WIRE_BEACON EVERY WIRE_BEACON_INTERVAL, EVEN WHILE ITS COMMANDS HANG
+ *      A WIRE_COMMAND IS  [ timeout_ms : 4 ][ command line ], THE AGENT KILLS A COMMAND STILL RUNNING timeout_ms AFTER IT STARTED
+ *
+ * HEADER-ONLY: client.c IS BUILT ON ITS OWN (SEE "COMPILE FOR WIN 64")
+ *
+ */
+
+enum WIRE_FRAME_TYPE {
+    WIRE_COMMAND = 1, // Server -> agent, payload is the command's deadline (WIRE_DEADLINE_SIZE) then its command line
+    WIRE_OUTPUT, // Agent -> server, next chunk of a command's output, as soon as it is produced
+    WIRE_OUTPUT_START, // Agent -> server, command started, empty payload
+    WIRE_OUTPUT_END, // Agent -> server, command finished, payload is its exit status in decimal (137 once killed at its deadline)
+    WIRE_OUTPUT_STDERR, // Agent -> server, next chunk of a command's stderr
+    WIRE_BEACON, // Agent -> server, liveness only, request_id 0 & empty payload
+};
+
+typedef struct wireFrame {
+    uint8_t type;
+    uint32_t request_id;
+    uint32_t len;
+    char* payload; // Points into the wireBuffer, NUL-terminated until the next wire_nextFrame()
+} wireFrame;
+
+typedef struct wireBuffer {
+    char* data;
+    size_t start; // First unconsumed byte
+    size_t end; // One past the last received byte
+    size_t cap;
+    char* patched; // Byte overwritten by the last frame's NUL terminator
+    char saved;
+} wireBuffer;
+
+static inline void wire_bufferInit(wireBuffer* buf) {
+    memset(buf, 0, sizeof(*buf));
+}
+
+static inline void wire_bufferFree(wireBuffer* buf) {
+    free(buf->data);
+    wire_bufferInit(buf);
+}
+
+static inline void wire_put32(unsigned char* p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static inline uint32_t wire_get32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static inline void wire_encodeHeader(unsigned char* out, uint8_t type, uint32_t request_id, uint32_t len) {
+    wire_put32(out, len);
+    out[4] = type;
+    wire_put32(out + 5, request_id);
+}
+
+static inline void wire_restore(wireBuffer* buf) {
+    if (buf->patched) {
+        *buf->patched = buf->saved;
+        buf->patched = NULL;
+    }
+}
+
+// Room for at least want bytes (+1 for the NUL wire_nextFrame() may write past a frame), NULL on allocation failure
+static inline char* wire_bufferReserve(wireBuffer* buf, size_t want, size_t* avail) {
+    wire_restore(buf);
+    if (buf->start == buf->end) buf->start = buf->end = 0;
+    if (buf->cap - buf->end < want + 1 && buf->start > 0) { // Slide the partial frame to the front first
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->cap - buf->end < want + 1) {
+        size_t cap = buf->cap ? buf->cap : WIRE_RECV_CHUNK;
+        while (cap - buf->end < want + 1) cap <<= 1;
+        char* data = realloc(buf->data, cap);
+        if (!data) return NULL;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    *avail = buf->cap - buf->end - 1;
+    return buf->data + buf->end;
+}
+
+static inline void wire_bufferCommit(wireBuffer* buf, size_t n) {
+    buf->end += n;
+}
+
+// Bytes still missing for the frame at the front of the buffer, a good recv() size hint
+static inline size_t wire_bufferWant(const wireBuffer* buf) {
+    size_t have = buf->end - buf->start;
+    if (have < WIRE_HEADER_SIZE) return WIRE_RECV_CHUNK;
+    uint32_t len = wire_get32((const unsigned char*)buf->data + buf->start);
+    if (len > WIRE_MAX_PAYLOAD) return WIRE_RECV_CHUNK; // wire_nextFrame() rejects it
+    size_t frame = WIRE_HEADER_SIZE + (size_t)len;
+    return frame > have + WIRE_RECV_CHUNK ? frame - have : WIRE_RECV_CHUNK;
+}
+
+// 1: frame filled in, 0: need more bytes, -1: corrupt stream (oversized length)
+static inline int wire_nextFrame(wireBuffer* buf, wireFrame* frame) {
+    wire_restore(buf);
+    size_t have = buf->end - buf->start;
+    if (have < WIRE_HEADER_SIZE) return 0;
+
+    const unsigned char* hdr = (const unsigned char*)buf->data + buf->start;
+    uint32_t len = wire_get32(hdr);
+    if (len > WIRE_MAX_PAYLOAD) return -1;
+    if (have < WIRE_HEADER_SIZE + (size_t)len) return 0;
+
+    frame->len = len;
+    frame->type = hdr[4];
+    frame->request_id = wire_get32(hdr + 5);
+    frame->payload = buf->data + buf->start + WIRE_HEADER_SIZE;
+    buf->start += WIRE_HEADER_SIZE + len;
+
+    buf->patched = frame->payload + len; // Always inside cap, reserve keeps one spare byte
+    buf->saved = *buf->patched;
+    *buf->patched = '\0';
+    return 1;
+}
+
+// Blocking send of the whole buffer, retries partial sends
+static inline int wire_sendAll(int sock, const char* data, size_t len) {
+    while (len > 0) {
+        int sent = send(sock, data, (int)len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (ERRNO == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static inline int wire_sendFrame(int sock, uint8_t type, uint32_t request_id, const char* payload, uint32_t len) {
+    unsigned char hdr[WIRE_HEADER_SIZE];
+    wire_encodeHeader(hdr, type, request_id, len);
+    if (wire_sendAll(sock, (const char*)hdr, WIRE_HEADER_SIZE) != 0) return -1;
+    return wire_sendAll(sock, payload, len);
+}
+
+#endif
+
+#endif // WIRE_H_INCLUDED